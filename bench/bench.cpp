@@ -0,0 +1,322 @@
+/**
+ * @file bench.cpp
+ * @brief Stage level benchmark of the colorisation pipeline.
+ * Times each stage separately over the color images of the data directory and over synthetic images
+ * from 256² to 8192², for every combination of samples, window size and thread count of the sweep.
+ * The results are written as CSV, or as JSON if the output file name ends with ".json".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <omp.h>
+
+#include "opencv2/imgproc.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include "WelshColorisation.hpp"
+#include "WelshColorisationStages.hpp"
+
+using namespace cv;
+
+#define DEFAULT_DATA_DIR "data"
+#define DEFAULT_REPEATS 3
+#define DEFAULT_MAX_SIZE 8192
+#define MIN_SYNTHETIC_SIZE 256
+#define MAX_DIFFUSION_PIXELS (512 * 512)  // diffuse_color is only timed on images up to this size
+#define SYNTHETIC_SEED 0x5eed
+
+static const int sweep_samples[] = {64, 256, 1024};
+static const int sweep_windows[] = {3, 5, 7, 9, 11};
+
+/**
+ * @brief Source and target images of a benchmark case
+ */
+struct bench_image_s {
+    String name;
+    Mat src;        // colored image (BGR)
+    Mat target;     // grayscale version of the source (BGR)
+};
+
+/**
+ * @brief Timing of one stage for one case of the sweep
+ */
+struct bench_result_s {
+    String image;
+    int width;
+    int height;
+    int samples;
+    int window;
+    int threads;
+    const char * stage;
+    double median_ms;
+    double min_ms;
+};
+
+/**
+ * @brief Times of one stage over the repeats of a case
+ */
+struct stage_times_s {
+    const char * stage;
+    std::vector<double> ms;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ms(bench_clock::time_point start) {
+    std::chrono::duration<double, std::milli> elapsed = bench_clock::now() - start;
+    return elapsed.count();
+}
+
+static void add_time(std::vector<stage_times_s>& times, const char * stage, double ms) {
+    for (size_t i = 0; i < times.size(); i++) {
+        if (strcmp(times[i].stage, stage) == 0) {
+            times[i].ms.push_back(ms);
+            return;
+        }
+    }
+    stage_times_s stage_times = {stage, std::vector<double>(1, ms)};
+    times.push_back(stage_times);
+}
+
+/**
+ * @brief Make a bench image whose target is the grayscale version of the source
+ */
+static bench_image_s make_bench_image(const String& name, const Mat& src) {
+    bench_image_s image;
+    image.name = name;
+    image.src = src;
+    cvtColor(src, image.target, COLOR_BGR2GRAY);
+    cvtColor(image.target, image.target, COLOR_GRAY2BGR);
+    return image;
+}
+
+/**
+ * @brief Load the color images of the data directory (the files whose name contains "gray" or "grey" are skipped)
+ */
+static void load_data_images(const char * data_dir, std::vector<bench_image_s>& images) {
+    std::vector<String> files;
+    glob(String(data_dir) + "/*", files, false);
+    for (size_t i = 0; i < files.size(); i++) {
+        if (files[i].find("gray") != String::npos || files[i].find("grey") != String::npos) continue;
+        Mat src = imread(files[i], IMREAD_COLOR);
+        if (src.empty()) continue;
+        images.push_back(make_bench_image(files[i].substr(files[i].find_last_of('/') + 1), src));
+    }
+}
+
+/**
+ * @brief Generate a smooth random color texture of the given size, identical between runs
+ */
+static Mat make_synthetic_image(int size) {
+    RNG rng(SYNTHETIC_SEED + size);
+    Mat coarse(16, 16, CV_8UC3), noise(size, size, CV_8UC3), img;
+    rng.fill(coarse, RNG::UNIFORM, 0, 256);
+    resize(coarse, img, Size(size, size), 0, 0, INTER_CUBIC);
+    rng.fill(noise, RNG::UNIFORM, 0, 24);
+    add(img, noise, img);
+    return img;
+}
+
+/**
+ * @brief Run all the stages of the pipeline on the given image, repeats times, and append the median and minimum times of each stage
+ */
+static void bench_case(const bench_image_s& image, int repeats, params prm, std::vector<bench_result_s>& results) {
+    std::vector<stage_times_s> times;
+    bool diffuse = image.src.total() <= MAX_DIFFUSION_PIXELS;
+    // one swatch in the middle of the image, at the same place in the source and in the target
+    vec_swatch swatches(1, Rect2d(image.src.cols / 4, image.src.rows / 4, image.src.cols / 2, image.src.rows / 2));
+
+    for (int r = 0; r < repeats; r++) {
+        Mat src = image.src.clone(), target = image.target.clone();
+        bench_clock::time_point start = bench_clock::now();
+        cvtColor(src, src, COLOR_BGR2Lab);
+        cvtColor(target, target, COLOR_BGR2Lab);
+        add_time(times, "bgr2lab", elapsed_ms(start));
+        Mat gray_lab = target.clone();
+
+        source_model_s model;
+        start = bench_clock::now();
+        build_source_model(model, src, prm);
+        add_time(times, "sampling", elapsed_ms(start));
+
+        Mat target_stats;
+        stat_buffers_s buffers;
+        start = bench_clock::now();
+        compute_neighborhood_stats(target, prm, target_stats, buffers);
+        Vec2d target_stat = get_image_stat(buffers);
+        add_time(times, "target_stats", elapsed_ms(start));
+
+        // same stage with the kernels for any window size, to measure the gain of the specialized ones
+        struct params_s generic_prm = *prm;
+        generic_prm.generic_kernels = true;
+        start = bench_clock::now();
+        compute_neighborhood_stats(target, &generic_prm, target_stats, buffers);
+        add_time(times, "target_stats_generic", elapsed_ms(start));
+
+        start = bench_clock::now();
+        bind_source_model(model, target_stat[0], target_stat[1], prm);
+        add_time(times, "luminance_remap", elapsed_ms(start));
+
+        start = bench_clock::now();
+        transfer_color(model, target, target_stats, prm);
+        add_time(times, "transfer_color", elapsed_ms(start));
+
+        // texture descriptors: their forest is built at bind, then searched for every pixel
+        struct params_s texture_prm = *prm;
+        texture_prm.descriptor = TEXTURE_DESCRIPTOR;
+        Mat texture_target = target.clone();
+        start = bench_clock::now();
+        bind_source_model(model, target_stat[0], target_stat[1], &texture_prm);
+        add_time(times, "texture_index", elapsed_ms(start));
+
+        start = bench_clock::now();
+        transfer_color_descriptors(model, texture_target, buffers.luminance, &texture_prm);
+        add_time(times, "texture_transfer", elapsed_ms(start));
+        free_source_model(model);
+
+        start = bench_clock::now();
+        cvtColor(target, target, COLOR_Lab2BGR);
+        add_time(times, "lab2bgr", elapsed_ms(start));
+
+        if (diffuse) {
+            std::vector<Mat> src_swatch_mat, target_swatch_mat;
+            get_swatch_matrices(src, gray_lab, swatches, swatches, src_swatch_mat, target_swatch_mat);
+            sample_and_transfer(src_swatch_mat[0], target_swatch_mat[0], prm);
+            // both runs draw the same swatch samples, from prm->seed
+            Mat diffused = gray_lab.clone();
+            start = bench_clock::now();
+            diffuse_color(diffused, target_swatch_mat, swatches, prm);
+            add_time(times, "diffuse_color", elapsed_ms(start));
+
+            // the swatch matrices point into gray_lab, which is still undiffused
+            diffused = gray_lab.clone();
+            start = bench_clock::now();
+            diffuse_color(diffused, target_swatch_mat, swatches, &generic_prm);
+            add_time(times, "diffuse_color_generic", elapsed_ms(start));
+        }
+    }
+
+    for (size_t i = 0; i < times.size(); i++) {
+        std::vector<double>& ms = times[i].ms;
+        std::sort(ms.begin(), ms.end());
+        bench_result_s result = {image.name, image.src.cols, image.src.rows, (int)prm->samples, (int)prm->neighborhood_window_size,
+                                 (int)prm->threads, times[i].stage, ms[ms.size() / 2], ms[0]};
+        results.push_back(result);
+    }
+}
+
+static void write_csv(FILE * out, const std::vector<bench_result_s>& results) {
+    fprintf(out, "image,width,height,samples,window,threads,stage,median_ms,min_ms\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result_s& r = results[i];
+        fprintf(out, "%s,%d,%d,%d,%d,%d,%s,%.3f,%.3f\n", r.image.c_str(), r.width, r.height, r.samples, r.window, r.threads, r.stage, r.median_ms, r.min_ms);
+    }
+}
+
+static void write_json(FILE * out, const std::vector<bench_result_s>& results, int repeats) {
+    fprintf(out, "{\n  \"repeats\": %d,\n  \"max_threads\": %d,\n  \"results\": [\n", repeats, omp_get_max_threads());
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result_s& r = results[i];
+        fprintf(out, "    {\"image\": \"%s\", \"width\": %d, \"height\": %d, \"samples\": %d, \"window\": %d, \"threads\": %d, "
+                     "\"stage\": \"%s\", \"median_ms\": %.3f, \"min_ms\": %.3f}%s\n",
+                r.image.c_str(), r.width, r.height, r.samples, r.window, r.threads, r.stage, r.median_ms, r.min_ms,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static void usage(const char * name) {
+    fprintf(stderr, "usage: %s [-d data_dir] [-o output.csv|output.json] [-r repeats] [-s max_size] [-S]\n", name);
+    fprintf(stderr, "  -d  directory of the images to benchmark (default: %s)\n", DEFAULT_DATA_DIR);
+    fprintf(stderr, "  -o  output file, JSON if its name ends with .json (default: CSV on the standard output)\n");
+    fprintf(stderr, "  -r  repeats of each case, the median time is reported (default: %d)\n", DEFAULT_REPEATS);
+    fprintf(stderr, "  -s  size of the largest synthetic image (default: %d)\n", DEFAULT_MAX_SIZE);
+    fprintf(stderr, "  -S  skip the synthetic images\n");
+}
+
+int main(int argc, char ** argv) {
+    int opt;
+    const char * data_dir = DEFAULT_DATA_DIR;
+    const char * output_path = NULL;
+    int repeats = DEFAULT_REPEATS;
+    int max_size = DEFAULT_MAX_SIZE;
+    bool synthetic = true;
+
+    while ((opt = getopt(argc, argv, "d:o:r:s:Sh")) != -1) {
+        switch (opt) {
+            case 'd':
+                data_dir = optarg;
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'r':
+                repeats = std::max(atoi(optarg), 1);
+                break;
+            case 's':
+                max_size = atoi(optarg);
+                break;
+            case 'S':
+                synthetic = false;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<bench_image_s> images;
+    load_data_images(data_dir, images);
+    if (synthetic) {
+        for (int size = MIN_SYNTHETIC_SIZE; size <= max_size; size *= 2) {
+            images.push_back(make_bench_image(format("synthetic_%d", size), make_synthetic_image(size)));
+        }
+    }
+    if (images.empty()) {
+        fprintf(stderr, "No image to benchmark\n");
+        return EXIT_FAILURE;
+    }
+
+    params default_prm = create_default_params();
+    struct params_s prm = *default_prm;
+    free(default_prm);
+
+    std::vector<int> sweep_threads(1, 1);
+    if (omp_get_max_threads() > 1) sweep_threads.push_back(omp_get_max_threads());
+
+    std::vector<bench_result_s> results;
+    for (size_t i = 0; i < images.size(); i++) {
+        for (size_t s = 0; s < sizeof(sweep_samples) / sizeof(sweep_samples[0]); s++) {
+            if ((size_t)sweep_samples[s] > images[i].src.total() / 4) continue; // the swatch is a quarter of the image
+            for (size_t w = 0; w < sizeof(sweep_windows) / sizeof(sweep_windows[0]); w++) {
+                for (size_t t = 0; t < sweep_threads.size(); t++) {
+                    prm.samples = sweep_samples[s];
+                    prm.neighborhood_window_size = sweep_windows[w];
+                    prm.threads = sweep_threads[t];
+                    fprintf(stderr, "%s (%dx%d): samples %d, window %d, threads %d\n", images[i].name.c_str(),
+                            images[i].src.cols, images[i].src.rows, prm.samples, prm.neighborhood_window_size, prm.threads);
+                    bench_case(images[i], repeats, &prm, results);
+                }
+            }
+        }
+    }
+
+    FILE * out = stdout;
+    if (output_path != NULL) {
+        out = fopen(output_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Cannot open %s\n", output_path);
+            return EXIT_FAILURE;
+        }
+    }
+    size_t len = output_path != NULL ? strlen(output_path) : 0;
+    if (len >= 5 && strcmp(output_path + len - 5, ".json") == 0) write_json(out, results, repeats);
+    else write_csv(out, results);
+    if (out != stdout) fclose(out);
+    return EXIT_SUCCESS;
+}
@@ -1,7 +1,10 @@
 #ifndef WELSH_COLORISATION_HPP
 #define WELSH_COLORISATION_HPP
 
+#include <stdio.h>
+#include <stdint.h>
 #include <vector>
+#include <stdexcept>
 
 #include "opencv2/imgproc.hpp"
 #include "opencv2/imgcodecs.hpp"
@@ -17,6 +20,25 @@ enum sampling_method {
     BRUTE_FORCE     // sample all pixels
 };
 
+/**
+ * @brief how to search the best matching sample of a pixel
+ * 
+ */
+enum search_method {
+    LINEAR_SEARCH,  // compare the pixel stats with every sample
+    KD_TREE,        // search a 2-d tree built over the samples stats (same matches as the linear search)
+    LOOKUP_TABLE    // read the match precomputed for the cell of the quantized (mean, stddev) plane (approximate)
+};
+
+/**
+ * @brief what describes the neighborhood of a pixel for the matching
+ * 
+ */
+enum descriptor_type {
+    STATS_DESCRIPTOR,   // (mean, stddev) of the luminance, searched with the search method
+    TEXTURE_DESCRIPTOR  // stats at two scales and gradient orientation histogram, searched with a random projection forest
+};
+
 /**
  * @brief parameters of the colorisation algorithm
  * 
@@ -25,13 +47,70 @@ struct params_s {
     uint neighborhood_window_size;  // size of the neighborhood window for pixel matching
     uint samples;                   // number of samples for the pixel matching (must be a square number)
     sampling_method sampling;       // how to sample pixel for the matching process
+    search_method search;           // how to search the best matching sample
+    double lut_resolution;          // size of a cell of the LOOKUP_TABLE search, in luminance units
+    int sequence_tolerance;         // maximum luminance difference for a tile of a frame to reuse the colors of the previous frame
     double mean_weight;             // weight of the mean luminance for determining the best match (stddev weight = 1-mean_weight)    
     bool show_samples;              // if true, samples points are colored
     bool verbose;                   // if true, print information about the color transfer
+    uint threads;                   // number of threads used by the color transfer (0 = OpenMP default)
+    uint strip_rows;                // height of the strips of the streaming mode
+    uint pyramid_levels;            // number of levels of the coarse-to-fine matching (1 = match every pixel at full resolution)
+    double pyramid_tolerance;       // maximum difference of the neighborhood stats of a pixel and its parent level pixel for reusing its colors 
+                                    // (a stats threshold, not a PSNR tolerance: verbose mode prints the PSNR against the flat matching)
+    bool generic_kernels;           // if true, the kernels specialized for the window sizes 3, 5, 7, 9 and 11 are not used (benchmark)
+    uint superpixel_size;           // width of the superpixels matched at once instead of every pixel (0 = match every pixel)
+    uint seed;                      // seed of the random sampling, the same seed giving the same samples
+    descriptor_type descriptor;     // what describes the neighborhood of a pixel (TEXTURE_DESCRIPTOR: full resolution per-pixel matching only)
+    uint forest_trees;              // number of trees of the TEXTURE_DESCRIPTOR search (0 = exact linear search)
 };
 
 typedef struct params_s * params;
 
+/**
+ * @brief performance report of the colorisation of a sequence
+ * 
+ */
+struct sequence_report_s {
+    int frames;                     // number of frames colorised
+    double seconds;                 // total run time
+    double frames_per_second;       // frames colorised per second
+    double reused_tiles;            // fraction of the tiles whose colors were reused from the previous frame
+};
+
+/**
+ * @brief performance report of the colorisation of a batch of images
+ * 
+ */
+struct batch_report_s {
+    int images;                     // number of images colorised
+    double seconds;                 // total run time
+    double images_per_second;       // images colorised per second
+    double decoded_queue_occupancy; // mean occupancy of the queue between the decoding and colorisation stages (fraction of its capacity)
+    double colorised_queue_occupancy; // mean occupancy of the queue between the colorisation and encoding stages (fraction of its capacity)
+};
+
+/**
+ * @brief quality and cost of a configuration measured by welsh_autotune
+ * 
+ */
+struct autotune_result_s {
+    struct params_s prm;            // the configuration
+    double psnr;                    // quality of the colorisation (dB)
+    double milliseconds;            // run time of the colorisation, sampling included (best of the repeats)
+    bool pareto;                    // true if no other configuration is both faster and better
+};
+
+/**
+ * @brief cost of the last edit of a SwatchSession
+ * 
+ */
+struct swatch_edit_report_s {
+    long pixels_searched;           // number of diffused pixels whose best sample was searched
+    long candidates_evaluated;      // number of error distances computed (not pruned)
+    double milliseconds;            // run time of the edit
+};
+
 /**
  * @brief General version of the Welsh et al. colorisation algorithm (no swatches)
  * 
@@ -55,6 +134,125 @@ void welsh_colorisation(Mat& source_img, Mat& target_img, const char * dst_img,
  */
 void welsh_colorisation_swatches(Mat& source_img, Mat& target_img, const char * dst_img, params prm, const std::vector<Rect2d>& src_rect, const std::vector<Rect2d>& target_rect);
 
+/**
+ * @brief Colorise a grayscale image with several colored images, for scenes no single image covers.
+ * Each source is sampled with the given parameters, in parallel, and all the samples are merged in 
+ * a single search structure. Each sample is remapped with the luminance distribution of its own source, 
+ * and every pixel of the target is matched once against the samples of all the sources.
+ * 
+ * @param source_imgs The mats of the colored images
+ * @param target_img The mat of the grayscale image
+ * @param dst_img The path of the result image
+ * @param prm 
+ */
+void welsh_colorisation_references(const std::vector<Mat>& source_imgs, Mat& target_img, const char * dst_img, params prm);
+
+/**
+ * @brief Colorise each frame of a grayscale sequence with the same source image.
+ * The source is sampled once for the whole sequence, and the tiles whose luminance did not change
+ * from the previous frame keep their colors.
+ * 
+ * @param source_img The mat of the colored image
+ * @param input The path of the grayscale video file, or of a directory of frames
+ * @param output The path of the result video file, or of the result directory if the input is a directory
+ * @param prm The parameters, with pyramid_levels 1, superpixel_size 0 and STATS_DESCRIPTOR
+ * @param report If not NULL, filled with the frame rate and the fraction of reused tiles
+ * @throw ColorisationError if the source is not a BGR image or the parameters ask for another matching than 
+ * the per-pixel stats one
+ */
+void welsh_colorisation_sequence(Mat& source_img, const char * input, const char * output, params prm, sequence_report_s * report);
+
+/**
+ * @brief Colorise many grayscale images with the same source image.
+ * The source is sampled once, and the decoding, colorisation and encoding of the images run 
+ * in a pipeline so the I/O overlaps with the computation.
+ * 
+ * @param source_img The mat of the colored image
+ * @param target_paths The paths of the grayscale images
+ * @param output_dir The directory where the results are written, with the name of their target
+ * @param prm The parameters, with pyramid_levels 1
+ * @param report If not NULL, filled with the throughput and the queue occupancy of the pipeline
+ * @throw ColorisationError if the source is not a BGR image or the parameters ask for the coarse-to-fine matching
+ */
+void welsh_colorisation_batch(Mat& source_img, const std::vector<String>& target_paths, const char * output_dir, params prm, batch_report_s * report);
+
+/**
+ * @brief Colorise a grayscale image too large to be loaded in memory, strip by strip.
+ * The target is read in strips of prm->strip_rows rows (plus the rows of the neighborhood window), 
+ * processed in parallel and written as soon as they are colorised. The memory used depends on the 
+ * strip height and the width of the target, not on its height, and the result is the same as the 
+ * one of welsh_colorisation.
+ * 
+ * @param source_img The mat of the colored image
+ * @param target_path The path of the grayscale image, binary PGM (P5) or PPM (P6) with 8 bits per channel
+ * @param dst_path The path of the result image, written as binary PPM (P6)
+ * @param prm The parameters, with pyramid_levels 1, superpixel_size 0 and STATS_DESCRIPTOR
+ * @throw ColorisationError if the source is not a BGR image, the parameters ask for another matching than 
+ * the per-pixel stats one, the target cannot be read or the result cannot be written
+ */
+void welsh_colorisation_streaming(Mat& source_img, const char * target_path, const char * dst_path, params prm);
+
+/**
+ * @brief Sample a source image once and write its model to a file: the samples position, chroma, 
+ * neighborhood luminance and stats, and the luminance remap parameters. The file is mapped in memory 
+ * and used in place by the Colorizer, so the source image is neither loaded nor sampled again.
+ * The search index depends on the target, so it is built when a target is colorised.
+ * 
+ * @param source_img The mat of the colored image, left untouched
+ * @param model_path The path of the model file, or a directory where it is named after its key
+ * @param prm The sampling parameters (window size, samples, sampling method and seed)
+ * @return uint64_t The key of the model, hash of the source pixels and the sampling parameters
+ */
+uint64_t welsh_build_model(Mat& source_img, const char * model_path, params prm);
+
+/**
+ * @brief Measure the quality (PSNR) and run time of a grid of configurations: samples (64 to 1024), 
+ * window size (3 to 9), sampling method, and 1 or all threads. The other parameters are the given ones.
+ * The run time is measured on the target. The quality is measured against the ground truth if there is 
+ * one, otherwise on the reference colorised from its own luminance.
+ * 
+ * @param reference The colored image (BGR)
+ * @param target The grayscale image (BGR or single channel)
+ * @param truth The colors of the target (BGR), or an empty mat
+ * @param prm The parameters not tuned
+ * @param results Receive the measures of each configuration, with their Pareto front
+ * @throw ColorisationError if the ground truth is not a BGR image of the size of the target
+ */
+void welsh_autotune(const Mat& reference, const Mat& target, const Mat& truth, params prm, std::vector<autotune_result_s>& results);
+
+/**
+ * @brief Select the best configuration measured by welsh_autotune for a time budget
+ * 
+ * @param results 
+ * @param budget_ms The maximum run time, in milliseconds
+ * @return int The index of the best quality within the budget, of the fastest configuration if none fits, 
+ * -1 if results is empty
+ */
+int welsh_autotune_select(const std::vector<autotune_result_s>& results, double budget_ms);
+
+/**
+ * @brief Read a parameters file: one "key = value" line per parameter, lines starting with # are ignored.
+ * The keys are window_size, samples, sampling (jittered or brute_force), search (kdtree, linear or lut), 
+ * lut_resolution, mean_weight, threads, seed, pyramid_levels, pyramid_tolerance, superpixel_size, descriptor 
+ * (stats or texture), forest_trees, strip_rows and sequence_tolerance. The parameters missing from the file are 
+ * left untouched.
+ * 
+ * @param path 
+ * @param prm 
+ * @return false if the file cannot be read or has an invalid line: unknown key or value, trailing characters, 
+ * value out of the range of the parameter (negative value of an unsigned parameter for instance)
+ */
+bool read_params_file(const char * path, params prm);
+
+/**
+ * @brief Write all the parameters to a file read by read_params_file
+ * 
+ * @param path 
+ * @param prm 
+ * @return false if the file cannot be written
+ */
+bool write_params_file(const char * path, params prm);
+
 /**
  * @brief Create a default params structure
  * 
@@ -62,4 +260,203 @@ void welsh_colorisation_swatches(Mat& source_img, Mat& target_img, const char *
  */
 params create_default_params();
 
-#endif
\ No newline at end of file
+/**
+ * @brief Write the instrumentation summary as JSON: the calls and time of each stage of the pipeline
+ * (color conversion, sampling, neighborhood stats, luminance remap, color transfer and diffusion) and 
+ * the pixels matched, candidates evaluated and pruned and bytes allocated, summed over all threads 
+ * then detailed per thread. Covers everything run since the start of the program or the last reset.
+ * 
+ * @param out 
+ */
+void instrumentation_write_json(FILE * out);
+
+/**
+ * @brief Reset the instrumentation times and counters. Must not be called while a colorisation runs.
+ * 
+ */
+void instrumentation_reset();
+
+/**
+ * @brief error raised by the Colorizer when its reference, parameters or target are invalid
+ * 
+ */
+class ColorisationError : public std::runtime_error {
+public:
+    explicit ColorisationError(const std::string& message) : std::runtime_error(message) {}
+};
+
+struct source_model_s;
+struct stat_buffers_s;
+struct swatch_session_s;
+
+/**
+ * @brief Reusable colorisation engine for a reference image.
+ * The reference is converted and sampled once, when the Colorizer is created. Each target then only 
+ * remaps the samples to its luminance distribution before the color transfer. Nothing is written to 
+ * disk, and the intermediate buffers, remap tables and search structures are kept between calls, so 
+ * colorising targets of the same size with the per-pixel matching of a single level (pyramid_levels 1 
+ * or several references, superpixel_size 0) does not allocate memory once the first one is done. The 
+ * coarse-to-fine and superpixel matchings allocate their buffers for each target.
+ * A Colorizer must not be used by several threads at the same time.
+ */
+class Colorizer {
+public:
+    /**
+     * @brief Sample the given reference image
+     * 
+     * @param reference The colored image (BGR), left untouched
+     * @param prm The parameters of the colorisation, copied
+     * @throw ColorisationError if the reference or the parameters are invalid
+     */
+    Colorizer(const Mat& reference, const struct params_s& prm);
+
+    /**
+     * @brief Sample several references and merge their samples, see welsh_colorisation_references.
+     * The coarse-to-fine matching is not available with several references (pyramid_levels is ignored).
+     * 
+     * @param references The colored images (BGR), left untouched
+     * @param prm The parameters of the colorisation, copied
+     * @throw ColorisationError if a reference or the parameters are invalid
+     */
+    Colorizer(const std::vector<Mat>& references, const struct params_s& prm);
+
+    /**
+     * @brief Map the model file of a reference, written by welsh_build_model, instead of sampling it.
+     * The coarse-to-fine matching is not available with a model file (pyramid_levels is ignored).
+     * 
+     * @param model_path The path of the model file
+     * @param prm The parameters of the colorisation, copied. The sampling parameters must be the ones 
+     * the model was built with
+     * @throw ColorisationError if the file is not a valid model or was built with other parameters
+     */
+    Colorizer(const char * model_path, const struct params_s& prm);
+    ~Colorizer();
+
+    /**
+     * @brief Colorise the given grayscale image.
+     * A single-channel target is converted to luminance in the result buffer directly, so it is neither 
+     * expanded to BGR nor copied to an intermediate LAB image.
+     * 
+     * @param target The grayscale image (BGR or single channel), left untouched
+     * @param dst The colorised image (BGR), reallocated only if its size or type does not match the target
+     * @throw ColorisationError if the target is invalid
+     */
+    void colorise(const Mat& target, Mat& dst);
+
+    /**
+     * @brief Colorise the given grayscale image, without converting the result back to BGR
+     * 
+     * @param target The grayscale image (BGR or single channel), left untouched
+     * @param dst The colorised image (LAB), reallocated only if its size or type does not match the target
+     * @throw ColorisationError if the target is invalid
+     */
+    void colorise_lab(const Mat& target, Mat& dst);
+
+    /**
+     * @brief Colorise the given grayscale image into its chromaticity only (A and B channels of LAB).
+     * The colors of a single-channel target are transferred to dst directly, without a LAB image, unless 
+     * the coarse-to-fine matching is used.
+     * 
+     * @param target The grayscale image (BGR or single channel), left untouched
+     * @param dst The chromaticity (CV_8UC2), reallocated only if its size or type does not match the target
+     * @throw ColorisationError if the target is invalid
+     */
+    void colorise_ab(const Mat& target, Mat& dst);
+
+    /**
+     * @brief Draw the samples taken from a reference on a copy of it, in red (show_samples)
+     * 
+     * @param reference A reference the Colorizer was created with (BGR)
+     * @param dst Receive the reference with its samples
+     * @param index The index of the reference among the ones the Colorizer was created with
+     */
+    void draw_samples(const Mat& reference, Mat& dst, int index = 0) const;
+
+    /**
+     * @brief The parameters of the colorisation
+     */
+    const struct params_s& parameters() const { return prm; }
+
+private:
+    Colorizer(const Colorizer&);
+    Colorizer& operator=(const Colorizer&);
+
+    struct params_s prm;
+    source_model_s * model;         // source model of each pyramid level
+    int levels;                     // number of pyramid levels of the reference
+    Mat target_lab;                 // target in LAB color space, colorised in place
+    Mat target_stats;               // neighborhood stats map of the target
+    stat_buffers_s * buffers;       // buffers of the neighborhood stats computation
+};
+
+/**
+ * @brief Swatch colorisation of a target that is edited incrementally.
+ * The session keeps the samples of every swatch and, for each pixel colored by the diffusion, the sample 
+ * it matched and its error distance. Adding a swatch only compares the pixels with its samples, and 
+ * removing one only searches again the pixels that matched its samples or that it colored, so the cost 
+ * of an edit depends on the swatch and the pixels it affects rather than on the whole set of swatches.
+ * The matches are the ones of a full search over the samples of the swatches in the session: render gives the 
+ * image of welsh_colorisation_swatches with the swatches of the session, in the order they were added.
+ * A SwatchSession must not be used by several threads at the same time.
+ */
+class SwatchSession {
+public:
+    /**
+     * @brief Start a session without swatches
+     * 
+     * @param source The colored image (BGR), copied
+     * @param target The grayscale image (BGR or single channel), copied
+     * @param prm The parameters of the colorisation, copied
+     * @throw ColorisationError if the images or the parameters are invalid
+     */
+    SwatchSession(const Mat& source, const Mat& target, const struct params_s& prm);
+    ~SwatchSession();
+
+    /**
+     * @brief Colorise a swatch of the target with a swatch of the source, and spread its colors to the 
+     * pixels that match its samples better than the previous ones
+     * 
+     * @param src_rect The swatch of the source
+     * @param target_rect The swatch of the target, colored over the previous swatches it overlaps
+     * @return int The id of the swatch
+     * @throw ColorisationError if a swatch is too small for its samples
+     */
+    int add_swatch(const Rect2d& src_rect, const Rect2d& target_rect);
+
+    /**
+     * @brief Remove a swatch and colorise again the pixels that depended on it
+     * 
+     * @param id 
+     * @throw ColorisationError if there is no such swatch
+     */
+    void remove_swatch(int id);
+
+    /**
+     * @brief Remove a swatch and add it again with new rectangles
+     * 
+     * @return int The new id of the swatch
+     * @throw ColorisationError if there is no such swatch or a swatch is too small for its samples
+     */
+    int move_swatch(int id, const Rect2d& src_rect, const Rect2d& target_rect);
+
+    /**
+     * @brief Write the current colorisation of the target
+     * 
+     * @param dst The colorised image (BGR)
+     */
+    void render(Mat& dst);
+
+    /**
+     * @brief The cost of the last add, remove or move
+     */
+    const swatch_edit_report_s& last_edit() const { return report; }
+
+private:
+    SwatchSession(const SwatchSession&);
+    SwatchSession& operator=(const SwatchSession&);
+
+    swatch_session_s * state;
+    swatch_edit_report_s report;
+};
+
+#endif
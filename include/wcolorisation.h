@@ -0,0 +1,143 @@
+#ifndef WCOLORISATION_H
+#define WCOLORISATION_H
+
+/**
+ * @file wcolorisation.h
+ * @brief C interface of libwcolorisation.
+ * The images are caller-owned 8-bit buffers described by a pointer, a size and a row stride in bytes.
+ * They are used in place: the library neither copies them nor writes anything to disk.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief result of the functions of the C interface
+ *
+ */
+typedef enum wc_status {
+    WC_OK = 0,
+    WC_INVALID_ARGUMENT,            // NULL pointer, bad size or stride, or invalid parameters
+    WC_INVALID_MODEL,               // model file missing, corrupted or built with other sampling parameters
+    WC_INTERNAL_ERROR               // unexpected failure (out of memory...)
+} wc_status;
+
+/**
+ * @brief how to search the best matching sample of a pixel, see search_method
+ *
+ */
+typedef enum wc_search {
+    WC_KD_TREE = 0,
+    WC_LINEAR_SEARCH,
+    WC_LOOKUP_TABLE
+} wc_search;
+
+/**
+ * @brief parameters of the colorisation, see params_s.
+ * Must be initialized with wc_params_default, which sets struct_size: fields added by later versions
+ * of the library are left to their default when an older caller passes a smaller structure.
+ *
+ */
+typedef struct wc_params {
+    uint32_t struct_size;           // sizeof(wc_params) of the caller
+    uint32_t window_size;           // size of the neighborhood window for pixel matching (odd)
+    uint32_t samples;               // number of samples for the pixel matching (square number)
+    uint32_t brute_force;           // if not 0, the first samples pixels are sampled instead of a jittered grid
+    wc_search search;               // how to search the best matching sample
+    double lut_resolution;          // size of a cell of the WC_LOOKUP_TABLE search, in luminance units
+    double mean_weight;             // weight of the mean luminance for determining the best match
+    uint32_t threads;               // number of threads (0 = all cores)
+    uint32_t seed;                  // seed of the random sampling
+    uint32_t pyramid_levels;        // number of levels of the coarse-to-fine matching (1 = full resolution)
+    double pyramid_tolerance;       // maximum stats difference for reusing the colors of the parent level
+    uint32_t superpixel_size;       // width of the superpixels matched at once (0 = match every pixel)
+    uint32_t texture_descriptor;    // if not 0, pixels are matched by texture descriptor instead of (mean, stddev)
+    uint32_t forest_trees;          // number of trees of the approximate texture descriptor search (0 = exact)
+} wc_params;
+
+/**
+ * @brief colorisation model of a reference image, reusable for any number of targets
+ *
+ */
+typedef struct wc_model wc_model;
+
+/**
+ * @brief Fill a parameters structure with the default values
+ *
+ * @param prm
+ */
+void wc_params_default(wc_params * prm);
+
+/**
+ * @brief Sample a reference image
+ *
+ * @param bgr The reference, 3 bytes (blue, green, red) per pixel
+ * @param width
+ * @param height
+ * @param stride The number of bytes between the start of two rows
+ * @param prm The parameters, NULL for the defaults. Copied
+ * @param model Receive the model, to be destroyed with wc_model_destroy
+ * @return wc_status
+ */
+wc_status wc_model_create(const uint8_t * bgr, int width, int height, size_t stride, const wc_params * prm, wc_model ** model);
+
+/**
+ * @brief Map a model file written by welsh_build_model (WelshColorisation --build-model)
+ *
+ * @param path
+ * @param prm The parameters, NULL for the defaults. The sampling parameters must be the ones the model was built with
+ * @param model Receive the model, to be destroyed with wc_model_destroy
+ * @return wc_status
+ */
+wc_status wc_model_load(const char * path, const wc_params * prm, wc_model ** model);
+
+/**
+ * @brief Destroy a model
+ *
+ * @param model The model, or NULL
+ */
+void wc_model_destroy(wc_model * model);
+
+/**
+ * @brief Colorise a grayscale image into a BGR image.
+ * A model keeps its buffers between calls, and must not be used by several threads at the same time.
+ *
+ * @param model
+ * @param gray The grayscale image, 1 byte per pixel
+ * @param width
+ * @param height
+ * @param gray_stride The number of bytes between the start of two rows of gray
+ * @param bgr Receive the colorised image, 3 bytes (blue, green, red) per pixel. Must not overlap gray
+ * @param bgr_stride The number of bytes between the start of two rows of bgr
+ * @return wc_status
+ */
+wc_status wc_colorise_bgr(wc_model * model, const uint8_t * gray, int width, int height, size_t gray_stride, uint8_t * bgr, size_t bgr_stride);
+
+/**
+ * @brief Colorise a grayscale image into the chromaticity channels of the LAB color space (8-bit OpenCV
+ * encoding: a and b offset by 128). See wc_colorise_bgr.
+ * The colors are written straight into ab: no LAB image is allocated, unless the model uses the coarse-to-fine 
+ * matching (pyramid_levels > 1), which needs the LAB image of the target.
+ *
+ * @param ab Receive the chromaticity, 2 bytes (a, b) per pixel. Must not overlap gray
+ * @param ab_stride The number of bytes between the start of two rows of ab
+ * @return wc_status
+ */
+wc_status wc_colorise_ab(wc_model * model, const uint8_t * gray, int width, int height, size_t gray_stride, uint8_t * ab, size_t ab_stride);
+
+/**
+ * @brief Message of the error of the last function returning a wc_status called by the calling thread
+ *
+ * @return const char* An empty string if that call succeeded (or no such call was made)
+ */
+const char * wc_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
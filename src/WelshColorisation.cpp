@@ -5,23 +5,85 @@
  */
 
 #include "WelshColorisation.hpp"
+#include "WelshColorisationStages.hpp"
+
+#include "opencv2/videoio.hpp"
 
 #include <string.h>
 #include <iostream>
 #include <algorithm>
 #include <chrono>
+#include <cfloat>
+#include <deque>
+#include <climits>
+#include <cerrno>
+#include <cstdlib>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <sys/mman.h>
 #include <omp.h>
+#ifdef WITH_GPERFTOOLS
+#include <gperftools/profiler.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define DEFAULT_NEIGHBORHOOD_SIZE 5
 #define DEFAULT_SAMPLES 256
 #define DEFAULT_SAMPLING JITTERED
 #define DEFAULT_MEAN_WEIGHT 0.5
+#define DEFAULT_THREADS 0
+#define DEFAULT_SEARCH KD_TREE
+#define DEFAULT_LUT_RESOLUTION 1.0
+#define DEFAULT_SEQUENCE_TOLERANCE 0
+#define DEFAULT_STRIP_ROWS 64
+#define DEFAULT_PYRAMID_LEVELS 1
+#define DEFAULT_PYRAMID_TOLERANCE 4.0
+#define DEFAULT_SUPERPIXEL_SIZE 0
+#define DEFAULT_GENERIC_KERNELS false
+#define DEFAULT_SEED 0x5eed
+#define DEFAULT_DESCRIPTOR STATS_DESCRIPTOR
+#define DEFAULT_FOREST_TREES 4
+
+#define TRANSFER_TILE_ROWS 16   // height of the row strips scheduled across threads by transfer_color
+#define PYRAMID_MIN_SIZE 32     // minimum size of the smallest side of the coarsest pyramid level
+#define SLIC_ITERATIONS 5        // iterations of the superpixel segmentation
+#define SLIC_COMPACTNESS 10.0    // luminance difference weighing as much as a superpixel step in the segmentation
+#define GUIDED_FILTER_EPS 1e-3   // regularization of the guided filter spreading the superpixel colors (luminance in [0, 1])
+#define SEQUENCE_TILE_SIZE 32   // size of the tiles whose matches are reused between frames of a sequence
+#define SWATCH_SAMPLES 64
+#define AUTOTUNE_REPEATS 3
+#define DESCRIPTOR_SIZE 8
+#define RP_LEAF_SIZE 16
+#define RECALL_CHECK_STEP 97
+#define TAN_PI_8 0.41421356f
+#define PARAMS_FILE_MAX_LINE 256
+#define DIFFUSION_TILE_SIZE 64
+#define PNM_MAX_HEADER_SIZE 256  // maximum size of the header of the PNM images of the streaming mode
+#define BATCH_QUEUE_CAPACITY 4  // maximum number of images waiting between two stages of the batch pipeline
+#define KD_TREE_LEAF_SIZE 8     // maximum number of samples in a kd-tree leaf, searched linearly
+#define MAX_LUMINANCE 256.0     // upper bound of the neighborhood mean luminance
+#define MAX_LUMINANCE_STDDEV 128.0  // upper bound of the neighborhood luminance standard deviation
+#define PROFILE_PATH_VARIABLE "WELSH_PROFILE"  // environment variable of the gperftools profile path
+#define DEFAULT_PROFILE_PATH "colorisation.prof"
+
+#define MODEL_FILE_MAGIC "WCMODEL"
+#define MODEL_FILE_VERSION 2
+#define MODEL_FILE_EXTENSION ".wcm"
+#define MODEL_MAX_WINDOW_SIZE 255
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
 
 #define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
 #define IN_RECT(x, y, rx, ry, rw, rh) (x >= rx &&  x < rx + rw && y >= ry &&  y < ry + rh)
 
-typedef std::vector<Rect2d> vec_swatch;
-
 /**
  * @brief log the given error message to the standard error output
  * 
@@ -58,6 +120,18 @@ params create_default_params() {
     prm->sampling = DEFAULT_SAMPLING;
     prm->show_samples = false;
     prm->verbose = false;
+    prm->threads = DEFAULT_THREADS;
+    prm->search = DEFAULT_SEARCH;
+    prm->lut_resolution = DEFAULT_LUT_RESOLUTION;
+    prm->sequence_tolerance = DEFAULT_SEQUENCE_TOLERANCE;
+    prm->strip_rows = DEFAULT_STRIP_ROWS;
+    prm->pyramid_levels = DEFAULT_PYRAMID_LEVELS;
+    prm->pyramid_tolerance = DEFAULT_PYRAMID_TOLERANCE;
+    prm->superpixel_size = DEFAULT_SUPERPIXEL_SIZE;
+    prm->generic_kernels = DEFAULT_GENERIC_KERNELS;
+    prm->seed = DEFAULT_SEED;
+    prm->descriptor = DEFAULT_DESCRIPTOR;
+    prm->forest_trees = DEFAULT_FOREST_TREES;
     return prm;
 }
 
@@ -76,6 +150,141 @@ void load_matrices(const char * src_path, const char * target_path, Mat& src, Ma
     exit_if(target.empty(), "Cannot load target image");
 }
 
+/**
+ * @brief Get the number of threads to use for the parallel sections
+ * 
+ * @param prm 
+ * @return int the number of threads set in the parameters, or the OpenMP default if it is 0
+ */
+int get_thread_count(params prm) {
+    return prm->threads > 0 ? (int)prm->threads : omp_get_max_threads();
+}
+
+/**
+ * @brief Stages of the pipeline timed by the instrumentation
+ */
+enum instrumented_stage {
+    STAGE_COLOR_CONVERSION,     // BGR <-> LAB conversions
+    STAGE_SAMPLING,             // build_source_model
+    STAGE_NEIGHBORHOOD_STATS,   // compute_neighborhood_stats
+    STAGE_LUMINANCE_REMAP,      // bind_source_model
+    STAGE_TRANSFER_COLOR,       // transfer_color
+    STAGE_DIFFUSE_COLOR,        // diffuse_color
+    NB_STAGES
+};
+
+static const char * stage_names[NB_STAGES] = {
+    "color_conversion", "sampling", "neighborhood_stats", "luminance_remap", "transfer_color", "diffuse_color"
+};
+
+/**
+ * @brief Counters of the instrumentation
+ */
+enum instrumented_counter {
+    COUNTER_PIXELS_MATCHED,         // pixels whose best match was searched
+    COUNTER_CANDIDATES_EVALUATED,   // samples whose distance to a pixel was computed
+    COUNTER_CANDIDATES_PRUNED,      // swatch samples skipped thanks to their SSD lower bound
+    COUNTER_BYTES_ALLOCATED,        // bytes of the buffers allocated by the pipeline
+    NB_COUNTERS
+};
+
+static const char * counter_names[NB_COUNTERS] = {
+    "pixels_matched", "candidates_evaluated", "candidates_pruned", "bytes_allocated"
+};
+
+/**
+ * @brief Times and counters recorded by one thread.
+ * Each thread only writes to its own slot, so recording costs no synchronisation.
+ */
+struct instrumentation_slot_s {
+    double seconds[NB_STAGES];
+    long calls[NB_STAGES];
+    long counters[NB_COUNTERS];
+};
+
+static std::mutex instrumentation_mutex;
+static std::vector<instrumentation_slot_s *> instrumentation_slots;   // slot of every thread that recorded something, kept after the thread exits
+static thread_local instrumentation_slot_s * instrumentation_slot = NULL;
+
+/**
+ * @brief Get the instrumentation slot of the calling thread, registered on its first use
+ * 
+ * @return instrumentation_slot_s& 
+ */
+instrumentation_slot_s& get_instrumentation_slot() {
+    if (instrumentation_slot == NULL) {
+        instrumentation_slot = new instrumentation_slot_s();
+        std::lock_guard<std::mutex> lock(instrumentation_mutex);
+        instrumentation_slots.push_back(instrumentation_slot);
+    }
+    return *instrumentation_slot;
+}
+
+/**
+ * @brief Add the given value to a counter of the calling thread
+ * 
+ * @param counter 
+ * @param value 
+ */
+inline void instrument_count(instrumented_counter counter, long value) {
+    get_instrumentation_slot().counters[counter] += value;
+}
+
+/**
+ * @brief Add the time spent in its scope to a stage of the calling thread
+ */
+struct stage_timer_s {
+    instrumented_stage stage;
+    std::chrono::steady_clock::time_point start;
+
+    stage_timer_s(instrumented_stage stage) : stage(stage), start(std::chrono::steady_clock::now()) {}
+    ~stage_timer_s() {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        instrumentation_slot_s& slot = get_instrumentation_slot();
+        slot.seconds[stage] += elapsed.count();
+        slot.calls[stage]++;
+    }
+};
+
+/**
+ * @brief Count the bytes of the given matrix as allocated if its data changed during a stage
+ * 
+ * @param mat 
+ * @param previous_data The data pointer of the matrix before the stage
+ */
+void count_mat_allocation(const Mat& mat, const uchar * previous_data) {
+    if (mat.data != previous_data) instrument_count(COUNTER_BYTES_ALLOCATED, mat.total() * mat.elemSize());
+}
+
+/**
+ * @brief cvtColor, timed as the color conversion stage
+ */
+void convert_color(const Mat& src, Mat& dst, int code) {
+    stage_timer_s timer(STAGE_COLOR_CONVERSION);
+    cvtColor(src, dst, code);
+}
+
+/**
+ * @brief Start the gperftools CPU profiler if the library is built with it (WITH_GPERFTOOLS), so only
+ * the compute region is profiled. The profile is written to the path set in the PROFILE_PATH_VARIABLE
+ * environment variable, or to DEFAULT_PROFILE_PATH.
+ */
+void start_profiler() {
+#ifdef WITH_GPERFTOOLS
+    const char * path = getenv(PROFILE_PATH_VARIABLE);
+    ProfilerStart(path != NULL ? path : DEFAULT_PROFILE_PATH);
+#endif
+}
+
+/**
+ * @brief Stop the gperftools CPU profiler started by start_profiler, and write the profile
+ */
+void stop_profiler() {
+#ifdef WITH_GPERFTOOLS
+    ProfilerStop();
+#endif
+}
+
 /**
  * @brief Get the sub matrices corresponding the swatches from the source and target image
  * given the swatches data from the colorisation structure
@@ -92,363 +301,3358 @@ void get_swatch_matrices(Mat& src, Mat& target, const vec_swatch& src_swatches,
 }
 
 /**
- * @brief Remap the luminance distribution of the source image to fit the one of the target image.
+ * @brief Compute the table remapping the source luminance distribution to fit the one of the target image.
  * See Hertzmann et al. paper "Image analogies" (2001)
  * 
- * @param colorisation The parameters of the colorisation
+ * @param src_mean The mean luminance of the source
+ * @param src_stddev The luminance standard deviation of the source
+ * @param target_mean The mean luminance of the target
+ * @param target_stddev The luminance standard deviation of the target
+ * @param lut The remapped value of each source luminance
  */
-void luminance_remap(Mat& src, Mat& target) {
-    Scalar src_mean, src_stddev, target_mean, target_stddev;
-    meanStdDev(src, src_mean, src_stddev);
-    meanStdDev(target, target_mean, target_stddev);
-    int cols = src.cols;
-    int rows = src.rows;
-    double ratio = target_stddev[0] / src_stddev[0]; // ratio of the luminance std deviation
-    for (int y = 0; y < rows; y++) {
-        for (int x = 0; x < cols; x++) {
-            Vec3b color = src.at<Vec3b>(y,x);
-            color[0] = ratio * (color[0] - src_mean[0]) + target_mean[0];
-            src.at<Vec3b>(y, x) = color;
-        }
+void compute_remap_lut(double src_mean, double src_stddev, double target_mean, double target_stddev, uchar lut[256]) {
+    double ratio = target_stddev / src_stddev; // ratio of the luminance std deviation
+    for (int l = 0; l < 256; l++) {
+        lut[l] = ratio * (l - src_mean) + target_mean;
     }
 }
 
 /**
  * @brief returns a rectangle representing the given pixel neighborhood 
  * 
- * @param img 
+ * @param img_size The size of the image, the neighborhood is clamped to its borders
  * @param x 
  * @param y 
  * @param prm 
  * @return Rect 
  */
-Rect get_neighborhood_rect(const Mat& img, int x, int y, params prm) {
+Rect get_neighborhood_rect(const Size& img_size, int x, int y, params prm) {
     int half_size = prm->neighborhood_window_size / 2;
     int size = prm->neighborhood_window_size;
-    int tx = CLAMP(x - half_size, 0, img.cols);
-    int ty = CLAMP(y - half_size, 0, img.rows);
-    int width = img.cols - (tx + size) < 0 ? img.cols - tx : prm->neighborhood_window_size; 
-    int height = img.rows - (ty + size) < 0 ? img.rows - ty : prm->neighborhood_window_size; 
+    int tx = CLAMP(x - half_size, 0, img_size.width);
+    int ty = CLAMP(y - half_size, 0, img_size.height);
+    int width = img_size.width - (tx + size) < 0 ? img_size.width - tx : prm->neighborhood_window_size; 
+    int height = img_size.height - (ty + size) < 0 ? img_size.height - ty : prm->neighborhood_window_size; 
     return Rect(tx, ty, width, height);
 }
 
+Rect get_neighborhood_rect(const Mat& img, int x, int y, params prm) {
+    return get_neighborhood_rect(img.size(), x, y, prm);
+}
+
 /**
- * @brief Computes the mean luminance and standard deviation of the neighborhood of the given pixel.
- * The neighborhood is a square centered on the given pixel and its size is stored in the colorisation struct.
+ * @brief Computes the mean luminance and standard deviation of the given rectangle from the
+ * summed-area tables of the luminance and squared luminance.
+ * Uses the same formula as cv::meanStdDev.
  * 
- * @param colorisation 
- * @param x The x coord of the pixel
- * @param y The y coord of the pixel
- * @return Vec2d A vector representing the (mean, stddev) luminance of the pixel's neighborhood
+ * @param sum The integral image of the luminance (CV_64F)
+ * @param sqsum The integral image of the squared luminance (CV_64F)
+ * @param rect The rectangle
+ * @return Vec2d A vector representing the (mean, stddev) luminance of the rectangle
  */
-Vec2d compute_pixel_neighborhood_stat(params prm, Mat& img, int x, int y) {
-    Rect rect = get_neighborhood_rect(img, x, y, prm);
-    Mat sub_mat = img(rect);
-    Scalar mean, stddev;
-    meanStdDev(sub_mat, mean, stddev);
-    return Vec2d(mean[0], stddev[0]);
+Vec2d compute_rect_stat(const Mat& sum, const Mat& sqsum, const Rect& rect) {
+    int x0 = rect.x, y0 = rect.y;
+    int x1 = rect.x + rect.width, y1 = rect.y + rect.height;
+    double s = sum.at<double>(y1, x1) - sum.at<double>(y0, x1) - sum.at<double>(y1, x0) + sum.at<double>(y0, x0);
+    double sq = sqsum.at<double>(y1, x1) - sqsum.at<double>(y0, x1) - sqsum.at<double>(y1, x0) + sqsum.at<double>(y0, x0);
+    double scale = 1.0 / rect.area();
+    double mean = s * scale;
+    double variance = std::max(sq * scale - mean * mean, 0.0);
+    return Vec2d(mean, sqrt(variance));
 }
 
 /**
- * @brief Compute the neighborhood stats of all pixels in the colored image.
+ * @brief Computes the neighborhood stats of the pixels of a row, for any window size
  * 
- * @param colorisation 
- * @param neighborhood_stats 
+ * @param sum The integral image of the luminance (CV_64F)
+ * @param sqsum The integral image of the squared luminance (CV_64F)
+ * @param size The size of the image
+ * @param y The row
+ * @param prm 
+ * @param row The stats of the pixels of the row
+ */
+void compute_stats_row_generic(const Mat& sum, const Mat& sqsum, const Size& size, int y, params prm, Vec2d * row) {
+    for (int x = 0; x < size.width; x++) {
+        row[x] = compute_rect_stat(sum, sqsum, get_neighborhood_rect(size, x, y, prm));
+    }
+}
+
+/**
+ * @brief Same as compute_stats_row_generic, for a window size known at compile time.
+ * The pixels whose window is not clamped read the integral images at constant offsets with a constant scale, 
+ * so the loop is unrolled and vectorized. The operations are the ones of compute_rect_stat, in the same order,
+ * so the stats are identical.
  */
-void brute_force_sampling(Mat& src, params prm, Vec2d * neighborhood_stats, std::vector<Vec2i>& neighborhood_pos) {
-    for (uint i = 0; i < prm->samples; i++) {
-        int x = i % src.rows;
-        int y = i / src.rows;
-        neighborhood_stats[i] = compute_pixel_neighborhood_stat(prm, src, x, y);
-        neighborhood_pos.push_back(Vec2i(x, y));
+template<int W>
+void compute_stats_row(const Mat& sum, const Mat& sqsum, const Size& size, int y, params prm, Vec2d * row) {
+    const int H = W / 2;
+    if (y < H || y + H >= size.height || size.width < W) {
+        compute_stats_row_generic(sum, sqsum, size, y, prm, row);
+        return;
+    }
+    const double scale = 1.0 / (W * W);
+    const double * sum0 = sum.ptr<double>(y - H), * sum1 = sum.ptr<double>(y + H + 1);
+    const double * sqsum0 = sqsum.ptr<double>(y - H), * sqsum1 = sqsum.ptr<double>(y + H + 1);
+    for (int x = 0; x < H; x++) row[x] = compute_rect_stat(sum, sqsum, get_neighborhood_rect(size, x, y, prm));
+    for (int x = H; x < size.width - H; x++) {
+        int x0 = x - H, x1 = x + H + 1;
+        double s = sum1[x1] - sum0[x1] - sum1[x0] + sum0[x0];
+        double sq = sqsum1[x1] - sqsum0[x1] - sqsum1[x0] + sqsum0[x0];
+        double mean = s * scale;
+        double variance = std::max(sq * scale - mean * mean, 0.0);
+        row[x] = Vec2d(mean, sqrt(variance));
     }
+    for (int x = size.width - H; x < size.width; x++) row[x] = compute_rect_stat(sum, sqsum, get_neighborhood_rect(size, x, y, prm));
 }
 
+typedef void (*stats_row_kernel)(const Mat&, const Mat&, const Size&, int, params, Vec2d *);
+
 /**
- * @brief Compute the neighborhood stats of pixels in the colored image based on random
- * jittered sampling.
+ * @brief Get the stats kernel of the window size of the parameters: specialized for the sizes of 
+ * 3, 5, 7, 9 and 11, unless prm->generic_kernels is set
  * 
- * @param colorisation 
- * @param neighborhood_stats 
+ * @param prm 
+ * @return stats_row_kernel 
+ */
+stats_row_kernel get_stats_row_kernel(params prm) {
+    if (prm->generic_kernels) return compute_stats_row_generic;
+    switch (prm->neighborhood_window_size) {
+        case 3: return compute_stats_row<3>;
+        case 5: return compute_stats_row<5>;
+        case 7: return compute_stats_row<7>;
+        case 9: return compute_stats_row<9>;
+        case 11: return compute_stats_row<11>;
+        default: return compute_stats_row_generic;
+    }
+}
+
+/**
+ * @brief Computes the neighborhood stats (mean, stddev) of every pixel of the luminance plane of the buffers.
+ * The integral images of L and L² are built once, so each pixel costs O(1) whatever the window size.
+ * The neighborhood of a pixel is clamped to the image borders like get_neighborhood_rect.
+ * 
+ * @param prm 
+ * @param stats The resulting map (CV_64FC2), stats.at<Vec2d>(y, x) is the (mean, stddev) of the pixel (x, y) 
+ * @param buffers The luminance plane, filled by the caller, and the integral images, reallocated only if the image size changes
+ */
+void compute_luminance_stats(params prm, Mat& stats, stat_buffers_s& buffers) {
+    stage_timer_s timer(STAGE_NEIGHBORHOOD_STATS);
+    const Mat& luminance = buffers.luminance;
+    const uchar * previous_data[3] = {buffers.sum.data, buffers.sqsum.data, stats.data};
+    integral(luminance, buffers.sum, buffers.sqsum, CV_64F, CV_64F);
+    stats.create(luminance.rows, luminance.cols, CV_64FC2);
+    count_mat_allocation(buffers.sum, previous_data[0]);
+    count_mat_allocation(buffers.sqsum, previous_data[1]);
+    count_mat_allocation(stats, previous_data[2]);
+    stats_row_kernel kernel = get_stats_row_kernel(prm);
+    #pragma omp parallel for num_threads(get_thread_count(prm))
+    for (int y = 0; y < luminance.rows; y++) {
+        kernel(buffers.sum, buffers.sqsum, luminance.size(), y, prm, stats.ptr<Vec2d>(y));
+    }
+}
+
+/**
+ * @brief Computes the neighborhood stats (mean, stddev) of the luminance of every pixel in the given image.
+ * 
+ * @param img The image in LAB color space
+ * @param prm 
+ * @param stats The resulting map (CV_64FC2), see compute_luminance_stats
+ * @param buffers The luminance plane and integral images, reallocated only if the image size changes
+ */
+void compute_neighborhood_stats(const Mat& img, params prm, Mat& stats, stat_buffers_s& buffers) {
+    const uchar * previous_luminance = buffers.luminance.data;
+    extractChannel(img, buffers.luminance, 0);
+    count_mat_allocation(buffers.luminance, previous_luminance);
+    compute_luminance_stats(prm, stats, buffers);
+}
+
+/**
+ * @brief LAB luminance of each gray level, with the conversion of a gray pixel of a 3-channel image,
+ * so a single-channel target gets the luminance it would have had as a BGR image
+ * 
+ * @param lut The luminance of each gray level
+ */
+void compute_gray_luminance_lut(uchar lut[256]) {
+    Mat gray(1, 256, CV_8UC3), lab;
+    for (int g = 0; g < 256; g++) gray.at<Vec3b>(0, g) = Vec3b(g, g, g);
+    cvtColor(gray, lab, COLOR_BGR2Lab);
+    for (int g = 0; g < 256; g++) lut[g] = lab.at<Vec3b>(0, g)[0];
+}
+
+/**
+ * @brief Convert a single-channel target to its luminance in one pass: the luminance is written to the
+ * luminance plane of the buffers and, if given, to the L channel of the LAB image the colors are transferred to.
+ * The LAB image is not a copy of the luminance: it is the result buffer of the caller, converted in place 
+ * to BGR by Lab2BGR, which needs its L channel. The luminance plane is the single-channel input of the 
+ * integral images, the superpixels and the descriptors, and is reused between calls. 
+ * Colorizer::colorise_ab allocates no LAB image at all.
+ * 
+ * @param gray The target (CV_8UC1)
+ * @param lab The LAB image, only its L channel is written, or NULL if the colors are transferred to a 
+ * chromaticity image (see Colorizer::colorise_ab)
+ * @param buffers 
+ * @param prm 
+ */
+void gray_to_luminance(const Mat& gray, Mat * lab, stat_buffers_s& buffers, params prm) {
+    stage_timer_s timer(STAGE_COLOR_CONVERSION);
+    uchar lut[256];
+    compute_gray_luminance_lut(lut);
+    const uchar * previous_luminance = buffers.luminance.data;
+    buffers.luminance.create(gray.size(), CV_8UC1);
+    count_mat_allocation(buffers.luminance, previous_luminance);
+    if (lab != NULL) {
+        const uchar * previous_lab = lab->data;
+        lab->create(gray.size(), CV_8UC3);
+        count_mat_allocation(*lab, previous_lab);
+    }
+    #pragma omp parallel for num_threads(get_thread_count(prm))
+    for (int y = 0; y < gray.rows; y++) {
+        const uchar * gray_row = gray.ptr<uchar>(y);
+        uchar * luminance_row = buffers.luminance.ptr<uchar>(y);
+        for (int x = 0; x < gray.cols; x++) luminance_row[x] = lut[gray_row[x]];
+        if (lab == NULL) continue;
+        Vec3b * lab_row = lab->ptr<Vec3b>(y);
+        for (int x = 0; x < gray.cols; x++) lab_row[x][0] = luminance_row[x];
+    }
+}
+
+void compute_neighborhood_stats(const Mat& img, params prm, Mat& stats) {
+    stat_buffers_s buffers;
+    compute_neighborhood_stats(img, prm, stats, buffers);
+}
+
+/**
+ * @brief Mean luminance and standard deviation of the whole image, from the integral images computed by compute_neighborhood_stats.
+ * Same result as cv::meanStdDev on the image.
+ * 
+ * @param buffers 
+ * @return Vec2d 
+ */
+Vec2d get_image_stat(const stat_buffers_s& buffers) {
+    return compute_rect_stat(buffers.sum, buffers.sqsum, Rect(0, 0, buffers.luminance.cols, buffers.luminance.rows));
+}
+
+/**
+ * @brief Allocate the aligned arrays of a sample stats structure
+ * 
+ * @param stats The structure to allocate
+ * @param size The number of samples
+ */
+void alloc_sample_stats(sample_stats_s& stats, int size) {
+    stats.size = size;
+    stats.mean = (float *) fastMalloc(sizeof(float) * std::max(size, 1));
+    stats.stddev = (float *) fastMalloc(sizeof(float) * std::max(size, 1));
+    instrument_count(COUNTER_BYTES_ALLOCATED, 2 * sizeof(float) * std::max(size, 1));
+}
+
+/**
+ * @brief Free the arrays of a sample stats structure
+ * 
+ * @param stats 
+ */
+void free_sample_stats(sample_stats_s& stats) {
+    fastFree(stats.mean);
+    fastFree(stats.stddev);
+    stats.mean = stats.stddev = NULL;
+    stats.size = 0;
+}
+
+/**
+ * @brief Sample all pixels in the colored image.
+ * 
+ * @param size The size of the colored image
+ * @param neighborhood_pos The position of the samples
+ */
+void brute_force_sampling(const Size& size, params prm, std::vector<Vec2i>& neighborhood_pos) {
+    uint nb_samples = std::min(prm->samples, (uint)size.area());
+    for (uint i = 0; i < nb_samples; i++) {
+        neighborhood_pos.push_back(Vec2i(i % size.width, i / size.width));
+    }
+}
+
+/**
+ * @brief Sample pixels in the colored image based on random jittered sampling.
+ * 
+ * @param size The size of the colored image
+ * @param rng The random generator of the jitter, seeded with prm->seed so the samples are reproducible
+ * @param neighborhood_pos The position of the samples
  */
-void jittered_sampling(Mat& src, params prm, Vec2d * neighborhood_stats, std::vector<Vec2i>& neighborhood_pos) {
+void jittered_sampling(const Size& size, params prm, RNG& rng, std::vector<Vec2i>& neighborhood_pos) {
     int n = sqrt(prm->samples);
-    int grid_x = src.cols / n; 
-    int grid_y = src.rows / n;
-    int index = 0;
+    int grid_x = size.width / n; 
+    int grid_y = size.height / n;
     for (int x = 0; x < n; x++) {
         for (int y = 0; y < n; y++) {
-            int pos_x = x * grid_x + (rand() % grid_x);
-            int pos_y = y * grid_y + (rand() % grid_y);
-            if (neighborhood_stats != NULL)
-                neighborhood_stats[index] = compute_pixel_neighborhood_stat(prm, src, pos_x, pos_y);
+            int pos_x = x * grid_x + rng.uniform(0, grid_x);
+            int pos_y = y * grid_y + rng.uniform(0, grid_y);
             neighborhood_pos.push_back(Vec2i(pos_x, pos_y));
-            index++;
         }
     } 
 }
 
 /**
- * @brief With the given pixel stats, find its closest match in the colored image.
- * The closest match is based on the pixel's neighborhood weighted mean and standard
- * deviation (by default, 50% for both).
- * 
- * @param colorisation 
- * @param target_stats 
- * @return int 
+ * @brief Weighted square difference between a pixel stats and a sample stats.
+ * This is the matching metric of every search method: the SIMD kernels evaluate the exact same 
+ * float operations, in the same order, so all of them find the same matches.
  */
-int find_best_matching_pixel(params prm, Vec2d * neighborhood_stat, int size, const Vec2d& target_stats) {
-    double diffs[size];
-    double target_mean, src_mean, target_stddev, src_stddev;
-    double weight_mean = prm->mean_weight;
-    double weight_dev = 1.0 - prm->mean_weight; 
-    
-    // compute the weighted square difference between the samples and given neighborhoods
-    #pragma omp parallel for
-    for (int i = 0; i < size; i++) {
-        target_mean = target_stats[0];
-        target_stddev = target_stats[1];
-        src_mean = neighborhood_stat[i][0];
-        src_stddev = neighborhood_stat[i][1];
-        diffs[i] = (weight_mean * (target_mean - src_mean) * (target_mean - src_mean)) 
-                + (weight_dev * (target_stddev - src_stddev) * (target_stddev - src_stddev)); 
-    }
-
-    // find the minimum value among the squared differences
-    double min_diff = INT_MAX;
+inline float stat_diff(float weight_mean, float weight_dev, float target_mean, float target_stddev, float src_mean, float src_stddev) {
+    float diff_mean = target_mean - src_mean;
+    float diff_stddev = target_stddev - src_stddev;
+    return weight_mean * diff_mean * diff_mean + weight_dev * diff_stddev * diff_stddev;
+}
+
+/**
+ * @brief Portable argmin kernel of find_best_matching_pixel 
+ */
+int argmin_stat_diff_scalar(const sample_stats_s& stats, float target_mean, float target_stddev, float weight_mean, float weight_dev) {
+    float min_diff = FLT_MAX;
     int min_index = 0;
-    #pragma omp parallel for
-    for (int i = 0; i < size; i++) {
-        if (diffs[i] < min_diff) {
-            min_diff = diffs[i];
+    for (int i = 0; i < stats.size; i++) {
+        float diff = stat_diff(weight_mean, weight_dev, target_mean, target_stddev, stats.mean[i], stats.stddev[i]);
+        if (diff < min_diff) {
+            min_diff = diff;
             min_index = i;
         }
     }
     return min_index;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
 /**
- * @brief Compute the neighborhood stats for each pixel in the grayscale image
- * and find its best matching pixel in the colored image.
- * The chromaticity is then transferred from the best match to the grayscale pixel (A and B channels).  
- * 
- * @param colorisation 
- * @param neighborhood_stat 
+ * @brief Reduce the per-lane minimums of a SIMD argmin, then finish the scan of the samples that
+ * do not fill a whole vector. Ties are resolved in favor of the lowest index, like the scalar kernel.
  */
-void transfer_color(Mat& src, Mat& target, params prm, Vec2d * neighborhood_stat, const std::vector<Vec2i>& neighborhood_pos) {
-    // #pragma omp parallel for collapse(2)
-    for (int x = 0; x < target.cols; x++) {
-        for (int y = 0; y < target.rows; y++) {
-            Vec2d stats = compute_pixel_neighborhood_stat(prm, target, x, y);
-            int match_index = find_best_matching_pixel(prm, neighborhood_stat, prm->samples, stats);
-            if (prm->verbose) printf("Matching position index: %d (target: %d %d)\n", match_index, x, y);
-            Vec3b color = target.at<Vec3b>(y, x);
-            Vec3b matching_color = src.at<Vec3b>(neighborhood_pos[match_index][1], neighborhood_pos[match_index][0]);
-            color[1] = matching_color[1];
-            color[2] = matching_color[2];
-            target.at<Vec3b>(y, x) = color; 
+int argmin_reduce_lanes(const float * lane_diff, const int * lane_index, int lanes, const sample_stats_s& stats, int begin, 
+                        float target_mean, float target_stddev, float weight_mean, float weight_dev) {
+    float min_diff = FLT_MAX;
+    int min_index = 0;
+    for (int l = 0; l < lanes; l++) {
+        if (lane_diff[l] < min_diff || (lane_diff[l] == min_diff && lane_index[l] < min_index)) {
+            min_diff = lane_diff[l];
+            min_index = lane_index[l];
+        }
+    }
+    for (int i = begin; i < stats.size; i++) {
+        float diff = stat_diff(weight_mean, weight_dev, target_mean, target_stddev, stats.mean[i], stats.stddev[i]);
+        if (diff < min_diff) {
+            min_diff = diff;
+            min_index = i;
         }
     }
+    return min_index;
 }
 
-void sample_and_transfer(Mat& src, Mat& target, params prm) {
-    // match source and target luminance histogram
-    luminance_remap(src, target);
-    
-    // sample pixels in source image and compute their neighborhood stats
-    Vec2d * neighborhood_stats = (Vec2d *) malloc(sizeof(Vec2d) * prm->samples);
-    exit_if(neighborhood_stats == NULL, "Error allocating neighborhood stat array\n");
-    std::vector<Vec2i> neighborhood_pos;
-    switch (prm->sampling) {
-        case JITTERED:
-            jittered_sampling(src, prm, neighborhood_stats, neighborhood_pos);
-            break;
-        case BRUTE_FORCE:
-            brute_force_sampling(src, prm, neighborhood_stats, neighborhood_pos);
-            break;
+/**
+ * @brief SSE2 argmin kernel of find_best_matching_pixel: 4 samples per iteration, each lane
+ * keeps its running minimum and the index where it was found.
+ */
+__attribute__((target("sse2")))
+int argmin_stat_diff_sse2(const sample_stats_s& stats, float target_mean, float target_stddev, float weight_mean, float weight_dev) {
+    const __m128 tm = _mm_set1_ps(target_mean), ts = _mm_set1_ps(target_stddev);
+    const __m128 wm = _mm_set1_ps(weight_mean), wd = _mm_set1_ps(weight_dev);
+    __m128 min_diff = _mm_set1_ps(FLT_MAX);
+    __m128i min_index = _mm_setzero_si128();
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i step = _mm_set1_epi32(4);
+    int i = 0;
+    for (; i + 4 <= stats.size; i += 4) {
+        __m128 dm = _mm_sub_ps(tm, _mm_loadu_ps(stats.mean + i));
+        __m128 ds = _mm_sub_ps(ts, _mm_loadu_ps(stats.stddev + i));
+        __m128 diff = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(wm, dm), dm), _mm_mul_ps(_mm_mul_ps(wd, ds), ds));
+        __m128 lower = _mm_cmplt_ps(diff, min_diff);
+        min_diff = _mm_or_ps(_mm_and_ps(lower, diff), _mm_andnot_ps(lower, min_diff));
+        __m128i lower_i = _mm_castps_si128(lower);
+        min_index = _mm_or_si128(_mm_and_si128(lower_i, index), _mm_andnot_si128(lower_i, min_index));
+        index = _mm_add_epi32(index, step);
     }
+    alignas(16) float lane_diff[4];
+    alignas(16) int lane_index[4];
+    _mm_store_ps(lane_diff, min_diff);
+    _mm_store_si128((__m128i *) lane_index, min_index);
+    return argmin_reduce_lanes(lane_diff, lane_index, 4, stats, i, target_mean, target_stddev, weight_mean, weight_dev);
+}
 
-    // find the best color match for each grayscale pixel and transfer its color
-    transfer_color(src, target, prm, neighborhood_stats, neighborhood_pos);
-    free(neighborhood_stats);
+/**
+ * @brief AVX2 argmin kernel of find_best_matching_pixel: 8 samples per iteration.
+ * FMA is deliberately not enabled, it would change the rounding of the distances.
+ */
+__attribute__((target("avx2")))
+int argmin_stat_diff_avx2(const sample_stats_s& stats, float target_mean, float target_stddev, float weight_mean, float weight_dev) {
+    const __m256 tm = _mm256_set1_ps(target_mean), ts = _mm256_set1_ps(target_stddev);
+    const __m256 wm = _mm256_set1_ps(weight_mean), wd = _mm256_set1_ps(weight_dev);
+    __m256 min_diff = _mm256_set1_ps(FLT_MAX);
+    __m256i min_index = _mm256_setzero_si256();
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+    int i = 0;
+    for (; i + 8 <= stats.size; i += 8) {
+        __m256 dm = _mm256_sub_ps(tm, _mm256_loadu_ps(stats.mean + i));
+        __m256 ds = _mm256_sub_ps(ts, _mm256_loadu_ps(stats.stddev + i));
+        __m256 diff = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(wm, dm), dm), _mm256_mul_ps(_mm256_mul_ps(wd, ds), ds));
+        __m256 lower = _mm256_cmp_ps(diff, min_diff, _CMP_LT_OQ);
+        min_diff = _mm256_blendv_ps(min_diff, diff, lower);
+        min_index = _mm256_blendv_epi8(min_index, index, _mm256_castps_si256(lower));
+        index = _mm256_add_epi32(index, step);
+    }
+    alignas(32) float lane_diff[8];
+    alignas(32) int lane_index[8];
+    _mm256_store_ps(lane_diff, min_diff);
+    _mm256_store_si256((__m256i *) lane_index, min_index);
+    return argmin_reduce_lanes(lane_diff, lane_index, 8, stats, i, target_mean, target_stddev, weight_mean, weight_dev);
 }
+#endif
+
+typedef int (*argmin_kernel)(const sample_stats_s&, float, float, float, float);
 
 /**
- * @brief 
+ * @brief Select the fastest argmin kernel supported by the running CPU (checked once)
  * 
- * @param target 
- * @param x 
- * @param y 
- * @param sx 
- * @param sy 
- * @param prm 
- * @return Vec4i 
+ * @return argmin_kernel 
  */
-Vec4i get_min_neighbordhood_rect(const Mat& target, int x, int y, int sx, int sy, params prm) {
-    int half_size = prm->neighborhood_window_size / 2;
-    int ox = std::min(std::min(x, sx), half_size);
-    int oy = std::min(std::min(y, sy), half_size);
-    int sizex = std::min((int)prm->neighborhood_window_size, std::min(target.cols - (x - ox), target.cols - (sx - ox)));
-    int sizey = std::min((int)prm->neighborhood_window_size, std::min(target.rows - (y - oy), target.rows - (sy - oy)));
-    return Vec4i(ox, oy, sizex, sizey);
+argmin_kernel get_argmin_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const argmin_kernel kernel = __builtin_cpu_supports("avx2") ? argmin_stat_diff_avx2 
+                                      : __builtin_cpu_supports("sse2") ? argmin_stat_diff_sse2 
+                                      : argmin_stat_diff_scalar;
+    return kernel;
+#else
+    return argmin_stat_diff_scalar;
+#endif
 }
 
-double compute_sq_diff(const Mat& target, const Vec4i& rect, int x, int y, int sx, int sy) {
-    double sum = 0.0;
-    Vec3b colored, gray;
-    #pragma omp parallel for collapse(2)
-    for (int xx = 0; xx < rect[2]; xx++) {
-        for (int yy = 0; yy < rect[3]; yy++) {
-            gray = target.at<Vec3b>(x+xx-rect[0], y+yy-rect[1]);
-            colored = target.at<Vec3b>(sx+xx-rect[0], sy+yy-rect[1]);
-            sum += (gray[0] - colored[0]) * (gray[0] - colored[0]);
-        }
-    }
-    return sum;
+/**
+ * @brief With the given pixel stats, find its closest match in the colored image.
+ * The closest match is based on the pixel's neighborhood weighted mean and standard
+ * deviation (by default, 50% for both). Ties are resolved in favor of the lowest index.
+ * The distances and the running minimum are computed in a single pass by a SIMD kernel.
+ * 
+ * @param colorisation 
+ * @param neighborhood_stat The samples stats
+ * @param target_stats 
+ * @return int 
+ */
+int find_best_matching_pixel(params prm, const sample_stats_s& neighborhood_stat, const Vec2d& target_stats) {
+    return get_argmin_kernel()(neighborhood_stat, target_stats[0], target_stats[1], prm->mean_weight, 1.0 - prm->mean_weight);
 }
 
 /**
- * @brief Get the coordinate of the colorised pixel (in a swatch) that minimise the error distance.
- * See Welsh et al. paper for the definition of the error distance.
- * 
- * @param pixel grayscale pixel to compute the error distance from
- * @param target_swatches list of all swatches in the target image
- * @return the coordinate of the colorised pixel (in a swatch) that minimise the error distance and the index of the swatch the pixel is from
- */
-int get_minimum_error_distance(const Mat& target, int x, int y, const std::vector<Vec2i>& swatch_samples, const vec_swatch& target_rect, params prm) {
-    double min_error_dist = 0xFFFF; // minimum error distance between the pixel neighborhood and a colorised pixel neighborhood
-    double min_index = 0;
-    // iterate over all colorised pixel and compute the error distance between the given pixel and the iterated pixel
-    Vec2i sample;
-    Vec4i rect;
-    // #pragma omp parallel for
-    for (size_t j = 0; j < swatch_samples.size(); j++) {
-        sample = swatch_samples[j];
-        rect = get_min_neighbordhood_rect(target, x, y, sample[0], sample[1], prm);
-        Mat a = target(Rect(x-rect[0], y-rect[1], rect[2], rect[3]));
-        Mat b = target(Rect(sample[0]-rect[0], sample[1]-rect[1], rect[2], rect[3]));
-        Mat c;
-        cv::absdiff(a, b, c);
-        c.convertTo(c, CV_32F);  // cannot make a square on 8 bits
-        c = c.mul(c);   
-        Scalar s = sum(c);
-        // sq_sum = compute_sq_diff(target, rect, x, y, sample[0], sample[1]);
-        if (s[0] < min_error_dist) {
-            min_error_dist = s[0];
-            min_index = j;
+ * @brief Recursively build the kd-tree nodes of the range [begin, end)
+ * 
+ * @param tree 
+ * @param neighborhood_stat 
+ * @param prm 
+ * @param begin 
+ * @param end 
+ */
+void build_kd_tree_node(kd_tree_s& tree, const sample_stats_s& neighborhood_stat, params prm, int begin, int end) {
+    if (end - begin <= KD_TREE_LEAF_SIZE) return;
+    // split along the axis with the largest weighted spread
+    const float * values[2] = {neighborhood_stat.mean, neighborhood_stat.stddev};
+    float min_val[2] = {FLT_MAX, FLT_MAX}, max_val[2] = {-FLT_MAX, -FLT_MAX};
+    for (int i = begin; i < end; i++) {
+        for (int a = 0; a < 2; a++) {
+            min_val[a] = std::min(min_val[a], values[a][tree.order[i]]);
+            max_val[a] = std::max(max_val[a], values[a][tree.order[i]]);
         }
     }
-    return min_index;
+    double spread_mean = prm->mean_weight * (max_val[0] - min_val[0]) * (max_val[0] - min_val[0]);
+    double spread_dev = (1.0 - prm->mean_weight) * (max_val[1] - min_val[1]) * (max_val[1] - min_val[1]);
+    int axis = spread_mean >= spread_dev ? 0 : 1;
+    const float * axis_values = values[axis];
+    int middle = begin + (end - begin) / 2;
+    std::nth_element(tree.order.begin() + begin, tree.order.begin() + middle, tree.order.begin() + end, [&](int a, int b) {
+        if (axis_values[a] != axis_values[b]) return axis_values[a] < axis_values[b];
+        return a < b;
+    });
+    tree.axis[middle] = axis;
+    build_kd_tree_node(tree, neighborhood_stat, prm, begin, middle);
+    build_kd_tree_node(tree, neighborhood_stat, prm, middle + 1, end);
 }
 
-void diffuse_color(Mat& target, std::vector<Mat>& target_swatches, const vec_swatch& target_rect, params prm) {
-    // get all samples from all swatches
-    std::vector<Vec2i> swatch_samples; 
-    for (size_t i = 0; i < target_swatches.size(); i++) {
-        std::vector<Vec2i> neighborhood_pos;
-        jittered_sampling(target_swatches[i], prm, NULL, neighborhood_pos);
-        for (size_t j = 0; j < neighborhood_pos.size(); j++) {
-            neighborhood_pos[j][0] += target_rect[i].x;
-            neighborhood_pos[j][1] += target_rect[i].y;
+/**
+ * @brief Build a kd-tree over the given samples stats
+ * 
+ * @param tree The tree to fill
+ * @param neighborhood_stat The samples stats
+ * @param prm 
+ */
+void build_kd_tree(kd_tree_s& tree, const sample_stats_s& neighborhood_stat, params prm) {
+    tree.order.resize(neighborhood_stat.size);
+    tree.axis.assign(neighborhood_stat.size, 0);
+    for (int i = 0; i < neighborhood_stat.size; i++) tree.order[i] = i;
+    build_kd_tree_node(tree, neighborhood_stat, prm, 0, neighborhood_stat.size);
+}
+
+/**
+ * @brief Search the range [begin, end) of the kd-tree for a sample closer than the current best match.
+ * A subtree is only skipped when the distance to its splitting line is strictly greater than the current best,
+ * and ties are resolved in favor of the lowest index, so the result is the one of the linear search.
+ * evaluated is incremented by the number of samples compared.
+ */
+void search_kd_tree_node(const kd_tree_s& tree, const sample_stats_s& neighborhood_stat, const float weights[2], const float target[2], 
+                         int begin, int end, float& min_diff, int& min_index, long& evaluated) {
+    if (end - begin <= KD_TREE_LEAF_SIZE) {
+        evaluated += end - begin;
+        for (int i = begin; i < end; i++) {
+            int index = tree.order[i];
+            float diff = stat_diff(weights[0], weights[1], target[0], target[1], neighborhood_stat.mean[index], neighborhood_stat.stddev[index]);
+            if (diff < min_diff || (diff == min_diff && index < min_index)) {
+                min_diff = diff;
+                min_index = index;
+            }
         }
-        swatch_samples.insert(swatch_samples.end(), neighborhood_pos.begin(), neighborhood_pos.end());
+        return;
     }
-
-    // compute their stats
-    Vec2d * stats = (Vec2d *) malloc(sizeof(Vec2d) * swatch_samples.size());
-    exit_if(stats == NULL, "error allocating stats array");
-    for (size_t i = 0; i < swatch_samples.size(); i++) {
-        stats[i] = compute_pixel_neighborhood_stat(prm, target, swatch_samples[i][0], swatch_samples[i][1]);
+    int middle = begin + (end - begin) / 2;
+    int index = tree.order[middle];
+    evaluated++;
+    float diff = stat_diff(weights[0], weights[1], target[0], target[1], neighborhood_stat.mean[index], neighborhood_stat.stddev[index]);
+    if (diff < min_diff || (diff == min_diff && index < min_index)) {
+        min_diff = diff;
+        min_index = index;
     }
-
-    // #pragma omp parallel for collapse(2)
-    for (int x = 0; x < target.cols; x++) {
-        for (int y = 0; y < target.rows; y++) {
-            Vec3b pixel = target.at<Vec3b>(y, x);
-            if (pixel[1] != pixel[2] || pixel[1] != 128) continue; // skip already colorised pixels
-            // Vec2d pixel_stats = compute_pixel_neighborhood_stat(prm, target, x, y);
-            // int match_index = find_best_matching_pixel(prm, stats, swatch_samples.size(), pixel_stats);
-            int match_index = get_minimum_error_distance(target, x, y, swatch_samples, target_rect, prm);
-            if (prm->verbose) printf("Matched index %d (target: %d %d)", match_index, x, y);
-            Vec3b matching_color = target.at<Vec3b>(swatch_samples[match_index][1], swatch_samples[match_index][0]);
-            pixel[1] = matching_color[1];
-            pixel[2] = matching_color[2];
-            target.at<Vec3b>(y, x) = pixel; 
-        }
+    int axis = tree.axis[middle];
+    float delta = target[axis] - (axis == 0 ? neighborhood_stat.mean[index] : neighborhood_stat.stddev[index]);
+    bool left_first = delta < 0;
+    if (left_first) search_kd_tree_node(tree, neighborhood_stat, weights, target, begin, middle, min_diff, min_index, evaluated);
+    else search_kd_tree_node(tree, neighborhood_stat, weights, target, middle + 1, end, min_diff, min_index, evaluated);
+    // any sample on the other side is at least this far away
+    if (weights[axis] * delta * delta <= min_diff) {
+        if (left_first) search_kd_tree_node(tree, neighborhood_stat, weights, target, middle + 1, end, min_diff, min_index, evaluated);
+        else search_kd_tree_node(tree, neighborhood_stat, weights, target, begin, middle, min_diff, min_index, evaluated);
     }
-    free(stats);
 }
 
 /**
- * @brief Run the welsh colorisation algorithm
- * 1. Convert the source (color) and target (grayscale) images to LAB color space
- * 2. Match the source luminance histogram to the grayscale target 
- * 3. Compute the neighborhood stats (mean, stddev) of pixels in the source image
- * 4. For each pixel in the target, find a match in the source based on the result of step 3.
- * 5. Transfer the colors (A,B channels) of the matching pixel to the target.
+ * @brief Same as find_best_matching_pixel, but searches the kd-tree built over the samples stats.
  * 
-    cvtColor(*(colorisation->src), *(colorisation->src), COLOR_BGR2Lab);
- * @param colorisation 
+ * @param prm 
+ * @param tree 
+ * @param neighborhood_stat 
+ * @param target_stats 
+ * @param evaluated Incremented by the number of samples compared
+ * @return int 
  */
-void run(Mat& src, Mat& target, params prm) {
-    // convert source and target images to LAB col or space
-    cvtColor(src, src, COLOR_BGR2Lab);
-    cvtColor(target, target, COLOR_BGR2Lab);    
-
-    sample_and_transfer(src, target, prm);
-
-    // LAB->BGR conversion
-    cvtColor(target, target, COLOR_Lab2BGR);
-
-    if (prm->show_samples) {
-        cvtColor(src, src, COLOR_Lab2BGR);
-        imwrite("samples.png", src);
-    }    
+int find_best_matching_pixel_kd_tree(params prm, const kd_tree_s& tree, const sample_stats_s& neighborhood_stat, const Vec2d& target_stats, long& evaluated) {
+    float weights[2] = {(float)prm->mean_weight, (float)(1.0 - prm->mean_weight)};
+    float target[2] = {(float)target_stats[0], (float)target_stats[1]};
+    float min_diff = FLT_MAX;
+    int min_index = 0;
+    search_kd_tree_node(tree, neighborhood_stat, weights, target, 0, tree.order.size(), min_diff, min_index, evaluated);
+    return min_index;
 }
 
 /**
- * @brief Run the welsh algorithm with swatches
+ * @brief Precompute the best matching sample of every cell of the quantized (mean, stddev) plane
  * 
- * @param colorisation 
+ * @param table The table to fill
+ * @param tree The kd-tree over the samples stats
+ * @param neighborhood_stat The samples stats
+ * @param prm 
  */
-void run_swatch(Mat& src, Mat& target, const vec_swatch& src_swatches, const vec_swatch& target_swatches, params prm) {
-    // convert source and target images to LAB color space
-    cvtColor(src, src, COLOR_BGR2Lab);
-    cvtColor(target, target, COLOR_BGR2Lab);   
-    
-    // compute the sub matrices for each swatch
-    std::vector<Mat> src_swatch_mat, target_swatch_mat;
-    get_swatch_matrices(src, target, src_swatches, target_swatches, src_swatch_mat, target_swatch_mat);
-    
-    // apply general algo on each swatch (luminance remap + sampling + color transfer)
-    int nb_swatches = src_swatches.size();
-    int samples_save = prm->samples;
-    prm->samples = 64; // temporarily lower samples for the swatch color transfer
-    for (int i = 0; i < nb_swatches; i++) {
-        sample_and_transfer(src_swatch_mat[i], target_swatch_mat[i], prm);
+void build_match_table(match_table_s& table, const kd_tree_s& tree, const sample_stats_s& neighborhood_stat, params prm) {
+    table.resolution = prm->lut_resolution;
+    table.mean_bins = (int)ceil(MAX_LUMINANCE / table.resolution);
+    table.dev_bins = (int)ceil(MAX_LUMINANCE_STDDEV / table.resolution);
+    table.matches.resize(table.mean_bins * table.dev_bins);
+    long evaluated = 0;
+    #pragma omp parallel for num_threads(get_thread_count(prm)) schedule(dynamic) reduction(+:evaluated)
+    for (int j = 0; j < table.dev_bins; j++) {
+        for (int i = 0; i < table.mean_bins; i++) {
+            Vec2d cell_center((i + 0.5) * table.resolution, (j + 0.5) * table.resolution);
+            table.matches[j * table.mean_bins + i] = find_best_matching_pixel_kd_tree(prm, tree, neighborhood_stat, cell_center, evaluated);
+        }
     }
-
-    diffuse_color(target, target_swatch_mat, target_swatches, prm);
-    prm->samples = samples_save;
-
-    // LAB->BGR conversion
-    cvtColor(target, target, COLOR_Lab2BGR);    
+    instrument_count(COUNTER_CANDIDATES_EVALUATED, evaluated);
+    instrument_count(COUNTER_BYTES_ALLOCATED, table.matches.size() * sizeof(int));
 }
 
+/**
+ * @brief Approximate best matching sample of the given stats, read from the cell of the lookup table containing them
+ * 
+ * @param table 
+ * @param target_stats 
+ * @return int 
+ */
+inline int find_best_matching_pixel_table(const match_table_s& table, const Vec2d& target_stats) {
+    int i = CLAMP((int)(target_stats[0] / table.resolution), 0, table.mean_bins - 1);
+    int j = CLAMP((int)(target_stats[1] / table.resolution), 0, table.dev_bins - 1);
+    return table.matches[j * table.mean_bins + i];
+}
+
+/**
+ * @brief Hash the given bytes (64-bit FNV-1a)
+ * 
+ * @param hash The hash of the previous bytes, or FNV_OFFSET_BASIS
+ * @param data 
+ * @param size 
+ * @return uint64_t 
+ */
+uint64_t fnv1a_hash(uint64_t hash, const void * data, size_t size) {
+    const uchar * bytes = (const uchar *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @brief Hash the parameters a source model depends on: a model file is only used with the same ones
+ * 
+ * @param prm 
+ * @return uint64_t 
+ */
+uint64_t hash_model_params(params prm) {
+    int32_t values[] = { (int32_t)prm->neighborhood_window_size, (int32_t)prm->samples, (int32_t)prm->sampling, (int32_t)prm->seed };
+    return fnv1a_hash(FNV_OFFSET_BASIS, values, sizeof(values));
+}
+
+/**
+ * @brief Hash the size, type and pixels of an image
+ * 
+ * @param img 
+ * @return uint64_t 
+ */
+uint64_t hash_image(const Mat& img) {
+    int32_t header[] = { img.rows, img.cols, img.type() };
+    uint64_t hash = fnv1a_hash(FNV_OFFSET_BASIS, header, sizeof(header));
+    for (int y = 0; y < img.rows; y++) hash = fnv1a_hash(hash, img.ptr(y), img.cols * img.elemSize());
+    return hash;
+}
+
+/**
+ * @brief Round an offset of the model data up to the next multiple of 8 bytes
+ */
+inline size_t align_model_offset(size_t offset) {
+    return (offset + 7) & ~(size_t)7;
+}
+
+/**
+ * @brief Compute the neighborhood stats of the samples of a model, with their luminance remapped by
+ * the table of their source image. Same formula as compute_rect_stat.
+ * 
+ * @param model 
+ * @param luts The luminance remap table of each source image of the model, 256 entries each
+ * @param mean Receive the mean of each sample
+ * @param stddev Receive the standard deviation of each sample
+ * @param stride The number of floats between the stats of two samples 
+ */
+void compute_model_stats(const source_model_s& model, const uchar * luts, float * mean, float * stddev, int stride) {
+    int patch_area = model.window_size * model.window_size;
+    for (int i = 0; i < model.nb_samples; i++) {
+        const uchar * lut = luts + 256 * model.origin[i];
+        const uchar * patch = model.patches + (size_t)i * patch_area;
+        int n = model.patch_size[i][0] * model.patch_size[i][1];
+        double s = 0.0, sq = 0.0;
+        for (int k = 0; k < n; k++) {
+            double l = lut[patch[k]];
+            s += l;
+            sq += l * l;
+        }
+        double scale = 1.0 / n;
+        double m = s * scale;
+        double variance = std::max(sq * scale - m * m, 0.0);
+        mean[(size_t)i * stride] = m;
+        stddev[(size_t)i * stride] = sqrt(variance);
+    }
+}
+
+/**
+ * @brief Initialize the header of model data and lay its arrays out
+ * 
+ * @param header 
+ * @param window_size 
+ * @param nb_samples 
+ * @param nb_origins The number of source images
+ */
+void init_model_header(model_file_header_s& header, int window_size, int nb_samples, int nb_origins) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+    header.version = MODEL_FILE_VERSION;
+    header.window_size = window_size;
+    header.nb_samples = nb_samples;
+    header.nb_origins = nb_origins;
+    size_t n = nb_samples;
+    header.origins_offset = align_model_offset(sizeof(header));
+    header.pos_offset = align_model_offset(header.origins_offset + nb_origins * sizeof(model_origin_s));
+    header.patch_size_offset = align_model_offset(header.pos_offset + n * sizeof(Vec2i));
+    header.origin_offset = align_model_offset(header.patch_size_offset + n * sizeof(Vec2i));
+    header.stats_offset = align_model_offset(header.origin_offset + n * sizeof(int32_t));
+    header.chroma_offset = align_model_offset(header.stats_offset + n * 2 * sizeof(float));
+    header.patches_offset = align_model_offset(header.chroma_offset + n * sizeof(Vec2b));
+    header.size = align_model_offset(header.patches_offset + n * window_size * window_size);
+}
+
+/**
+ * @brief Point the arrays of a model into its data (built in memory or mapped from a file), after 
+ * checking that the header describes arrays that fit in it
+ * 
+ * @param model 
+ * @param data The model data, starting with its header
+ * @param size The size of the data
+ * @return false if the data is not a valid model
+ */
+bool attach_model_data(source_model_s& model, const void * data, size_t size) {
+    if (size < sizeof(model_file_header_s)) return false;
+    const model_file_header_s * header = (const model_file_header_s *) data;
+    if (memcmp(header->magic, MODEL_FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != MODEL_FILE_VERSION) return false;
+    if (header->window_size <= 0 || header->window_size > MODEL_MAX_WINDOW_SIZE || header->window_size % 2 == 0 || header->size > size) return false;
+    // a mapped file is untrusted: the counts are bounded so that the array sizes below cannot overflow
+    if (header->nb_samples <= 0 || (uint64_t)header->nb_samples > header->size / sizeof(Vec2i)) return false;
+    if (header->nb_origins <= 0 || (uint64_t)header->nb_origins > header->size / sizeof(model_origin_s)) return false;
+    uint64_t n = header->nb_samples;
+    uint64_t arrays[][2] = {
+        { header->origins_offset, header->nb_origins * sizeof(model_origin_s) },
+        { header->pos_offset, n * sizeof(Vec2i) },
+        { header->patch_size_offset, n * sizeof(Vec2i) },
+        { header->origin_offset, n * sizeof(int32_t) },
+        { header->stats_offset, n * 2 * sizeof(float) },
+        { header->chroma_offset, n * sizeof(Vec2b) },
+        { header->patches_offset, n * (uint64_t)(header->window_size * header->window_size) }
+    };
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+        uint64_t offset = arrays[i][0], length = arrays[i][1];
+        if (offset < sizeof(model_file_header_s) || offset % 8 != 0 || offset > header->size || length > header->size - offset) return false;
+    }
+
+    const uchar * base = (const uchar *) data;
+    model.header = header;
+    model.window_size = header->window_size;
+    model.nb_samples = header->nb_samples;
+    model.nb_origins = header->nb_origins;
+    model.origins = (const model_origin_s *) (base + header->origins_offset);
+    model.pos = (const Vec2i *) (base + header->pos_offset);
+    model.patch_size = (const Vec2i *) (base + header->patch_size_offset);
+    model.origin = (const int32_t *) (base + header->origin_offset);
+    model.src_stats = (const float *) (base + header->stats_offset);
+    model.chroma = (const Vec2b *) (base + header->chroma_offset);
+    model.patches = base + header->patches_offset;
+    int half_size = model.window_size / 2;
+    for (int i = 0; i < model.nb_samples; i++) {
+        // the sample lies in its neighborhood, which is clamped like get_neighborhood_rect
+        for (int c = 0; c < 2; c++) {
+            if (model.patch_size[i][c] <= 0 || model.patch_size[i][c] > model.window_size) return false;
+            if (model.pos[i][c] < 0 || std::min(model.pos[i][c], half_size) >= model.patch_size[i][c]) return false;
+        }
+        if (model.origin[i] < 0 || model.origin[i] >= model.nb_origins) return false;
+    }
+
+    free_sample_stats(model.stats);
+    alloc_sample_stats(model.stats, model.nb_samples);
+    model.bound = false;
+    return true;
+}
+
+/**
+ * @brief Sample the source image and extract everything the color transfer needs from it:
+ * the position and chroma of each sample, the luminance of its neighborhood and its stats. 
+ * The model is independent of the target, see bind_source_model. Its data is laid out like a model 
+ * file, see save_source_model.
+ * 
+ * @param model The model to build
+ * @param src The source image in LAB color space
+ * @param prm 
+ */
+void build_source_model(source_model_s& model, const Mat& src, params prm) {
+    stage_timer_s timer(STAGE_SAMPLING);
+    Scalar src_mean, src_stddev;
+    meanStdDev(src, src_mean, src_stddev);
+
+    free_source_model(model);
+    std::vector<Vec2i> pos;
+    RNG rng(prm->seed);
+    switch (prm->sampling) {
+        case JITTERED:
+            jittered_sampling(src.size(), prm, rng, pos);
+            break;
+        case BRUTE_FORCE:
+            brute_force_sampling(src.size(), prm, pos);
+            break;
+    }
+
+    model_file_header_s header;
+    init_model_header(header, prm->neighborhood_window_size, pos.size(), 1);
+    header.params_hash = hash_model_params(prm);
+    size_t nb_samples = pos.size();
+    size_t patch_area = header.window_size * header.window_size;
+
+    model.storage.assign(header.size / sizeof(uint64_t), 0);
+    instrument_count(COUNTER_BYTES_ALLOCATED, header.size);
+    uchar * base = (uchar *) model.storage.data();
+    memcpy(base, &header, sizeof(header));
+    model_origin_s * origin = (model_origin_s *) (base + header.origins_offset);
+    origin->mean = src_mean[0];
+    origin->stddev = src_stddev[0];
+    Vec2i * model_pos = (Vec2i *) (base + header.pos_offset);
+    Vec2i * patch_size = (Vec2i *) (base + header.patch_size_offset);
+    Vec2b * chroma = (Vec2b *) (base + header.chroma_offset);
+    for (size_t i = 0; i < nb_samples; i++) {
+        model_pos[i] = pos[i];
+        const Vec3b& color = src.at<Vec3b>(pos[i][1], pos[i][0]);
+        chroma[i] = Vec2b(color[1], color[2]);
+        Rect rect = get_neighborhood_rect(src, pos[i][0], pos[i][1], prm);
+        patch_size[i] = Vec2i(rect.width, rect.height);
+        uchar * patch = base + header.patches_offset + i * patch_area;
+        for (int y = 0; y < rect.height; y++) {
+            const Vec3b * row = src.ptr<Vec3b>(rect.y + y) + rect.x;
+            for (int x = 0; x < rect.width; x++) {
+                *patch++ = row[x][0];
+            }
+        }
+    }
+
+    // the stats of the source luminance, used as is by the targets that need no remap
+    uchar identity[256];
+    for (int l = 0; l < 256; l++) identity[l] = l;
+    attach_model_data(model, base, header.size);
+    float * src_stats = (float *) (base + header.stats_offset);
+    compute_model_stats(model, identity, src_stats, src_stats + 1, 2);
+}
+
+/**
+ * @brief Merge the samples of several models into a single model, each sample keeping the source image 
+ * it was taken from (its origin), so it is remapped with the luminance distribution of that image
+ * 
+ * @param models The models to merge, with the same window size
+ * @param nb_models 
+ * @param merged Receive the samples of all the models, in order
+ */
+void merge_source_models(const source_model_s * models, int nb_models, source_model_s& merged) {
+    stage_timer_s timer(STAGE_SAMPLING);
+    int nb_samples = 0, nb_origins = 0;
+    for (int m = 0; m < nb_models; m++) {
+        nb_samples += models[m].nb_samples;
+        nb_origins += models[m].nb_origins;
+    }
+    int window_size = models[0].window_size;
+    size_t patch_area = window_size * window_size;
+
+    free_source_model(merged);
+    model_file_header_s header;
+    init_model_header(header, window_size, nb_samples, nb_origins);
+    header.params_hash = models[0].header->params_hash;
+    merged.storage.assign(header.size / sizeof(uint64_t), 0);
+    instrument_count(COUNTER_BYTES_ALLOCATED, header.size);
+    uchar * base = (uchar *) merged.storage.data();
+    memcpy(base, &header, sizeof(header));
+
+    size_t first = 0;
+    int first_origin = 0;
+    for (int m = 0; m < nb_models; m++) {
+        const source_model_s& model = models[m];
+        size_t n = model.nb_samples;
+        memcpy(base + header.origins_offset + first_origin * sizeof(model_origin_s), model.origins, model.nb_origins * sizeof(model_origin_s));
+        memcpy(base + header.pos_offset + first * sizeof(Vec2i), model.pos, n * sizeof(Vec2i));
+        memcpy(base + header.patch_size_offset + first * sizeof(Vec2i), model.patch_size, n * sizeof(Vec2i));
+        memcpy(base + header.stats_offset + first * 2 * sizeof(float), model.src_stats, n * 2 * sizeof(float));
+        memcpy(base + header.chroma_offset + first * sizeof(Vec2b), model.chroma, n * sizeof(Vec2b));
+        memcpy(base + header.patches_offset + first * patch_area, model.patches, n * patch_area);
+        int32_t * origin = (int32_t *) (base + header.origin_offset) + first;
+        for (size_t i = 0; i < n; i++) origin[i] = first_origin + model.origin[i];
+        first += n;
+        first_origin += model.nb_origins;
+    }
+    attach_model_data(merged, base, header.size);
+}
+
+/**
+ * @brief Sample several source images in parallel and merge their samples in a single model, see 
+ * merge_source_models. Each source is sampled with the given parameters.
+ * 
+ * @param model The model to build
+ * @param sources The source images in LAB color space
+ * @param prm 
+ */
+void build_merged_source_model(source_model_s& model, const std::vector<Mat>& sources, params prm) {
+    int nb_sources = sources.size();
+    source_model_s * models = new source_model_s[nb_sources];
+    #pragma omp parallel for schedule(dynamic) num_threads(get_thread_count(prm))
+    for (int i = 0; i < nb_sources; i++) build_source_model(models[i], sources[i], prm);
+    merge_source_models(models, nb_sources, model);
+    for (int i = 0; i < nb_sources; i++) free_source_model(models[i]);
+    delete[] models;
+}
+
+/**
+ * @brief Compute the texture descriptor of a pixel from its neighborhood window: the (mean, stddev) of
+ * the luminance of the whole window and of the inner window (half its size), and the mean gradient 
+ * magnitude in 4 orientations (0, 45, 90 and 135 degrees). Everything is in luminance units, so the 
+ * descriptors are compared with the euclidean distance.
+ * 
+ * @param block The first pixel of the window (clamped to the image borders, see get_neighborhood_rect)
+ * @param stride The number of bytes between two rows of the window
+ * @param width The width of the window
+ * @param height The height of the window
+ * @param cx The x coord of the pixel in the window
+ * @param cy The y coord of the pixel in the window
+ * @param lut The luminance remap table of the window
+ * @param descriptor Receive the DESCRIPTOR_SIZE values of the descriptor
+ */
+void compute_texture_descriptor(const uchar * block, size_t stride, int width, int height, int cx, int cy, const uchar lut[256], float * descriptor) {
+    int inner_half = std::max(width, height) / 4;
+    int ix0 = std::max(cx - inner_half, 0), ix1 = std::min(cx + inner_half + 1, width);
+    int iy0 = std::max(cy - inner_half, 0), iy1 = std::min(cy + inner_half + 1, height);
+    double s = 0.0, sq = 0.0, inner_s = 0.0, inner_sq = 0.0;
+    float histogram[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    int gradients = 0;
+    for (int y = 0; y < height; y++) {
+        const uchar * row = block + y * stride;
+        bool inner_row = y >= iy0 && y < iy1;
+        for (int x = 0; x < width; x++) {
+            double l = lut[row[x]];
+            s += l;
+            sq += l * l;
+            if (inner_row && x >= ix0 && x < ix1) {
+                inner_s += l;
+                inner_sq += l * l;
+            }
+            if (x == 0 || y == 0 || x == width - 1 || y == height - 1) continue;
+            // central differences, folded to the upper half plane (the orientation is unsigned)
+            float gx = 0.5f * (lut[row[x + 1]] - lut[row[x - 1]]);
+            float gy = 0.5f * (lut[row[x + stride]] - lut[row[x - stride]]);
+            if (gy < 0 || (gy == 0 && gx < 0)) {
+                gx = -gx;
+                gy = -gy;
+            }
+            float ax = fabsf(gx), ay = fabsf(gy);
+            int bin = ay <= TAN_PI_8 * ax ? 0 : ax <= TAN_PI_8 * ay ? 2 : gx > 0 ? 1 : 3;
+            histogram[bin] += ax + ay;
+            gradients++;
+        }
+    }
+    double scale = 1.0 / (width * height);
+    double mean = s * scale;
+    descriptor[0] = mean;
+    descriptor[1] = sqrt(std::max(sq * scale - mean * mean, 0.0));
+    double inner_scale = 1.0 / ((ix1 - ix0) * (iy1 - iy0));
+    double inner_mean = inner_s * inner_scale;
+    descriptor[2] = inner_mean;
+    descriptor[3] = sqrt(std::max(inner_sq * inner_scale - inner_mean * inner_mean, 0.0));
+    for (int b = 0; b < 4; b++) descriptor[4 + b] = gradients > 0 ? histogram[b] / gradients : 0.0f;
+}
+
+/**
+ * @brief Squared euclidean distance between two texture descriptors
+ */
+inline float descriptor_distance(const float * a, const float * b) {
+    float distance = 0.0f;
+    for (int k = 0; k < DESCRIPTOR_SIZE; k++) {
+        float diff = a[k] - b[k];
+        distance += diff * diff;
+    }
+    return distance;
+}
+
+/**
+ * @brief Build the subtree of a random projection tree over the given range of the order of the forest
+ * 
+ * @param forest 
+ * @param descriptors The descriptors of the samples
+ * @param begin 
+ * @param end 
+ * @param rng 
+ * @return int The index of the node
+ */
+int build_rp_node(rp_forest_s& forest, const std::vector<float>& descriptors, int begin, int end, RNG& rng) {
+    int node = forest.nodes.size();
+    rp_node_s leaf = { -1, -1, 0.0f, begin, end };
+    forest.nodes.push_back(leaf);
+    forest.directions.resize(forest.nodes.size() * DESCRIPTOR_SIZE, 0.0f);
+    if (end - begin <= RP_LEAF_SIZE) return node;
+
+    float * direction = &forest.directions[(size_t)node * DESCRIPTOR_SIZE];
+    for (int k = 0; k < DESCRIPTOR_SIZE; k++) direction[k] = rng.gaussian(1.0);
+    // the projections of a node are only used before its children are built, so all the nodes share the buffer
+    std::vector<std::pair<float, int> >& projections = forest.projections;
+    for (int i = begin; i < end; i++) {
+        const float * descriptor = &descriptors[(size_t)forest.order[i] * DESCRIPTOR_SIZE];
+        float projection = 0.0f;
+        for (int k = 0; k < DESCRIPTOR_SIZE; k++) projection += direction[k] * descriptor[k];
+        projections[i - begin] = std::make_pair(projection, forest.order[i]);
+    }
+    int middle = (end - begin) / 2;
+    std::nth_element(projections.begin(), projections.begin() + middle, projections.begin() + (end - begin));
+    for (int i = begin; i < end; i++) forest.order[i] = projections[i - begin].second;
+    forest.nodes[node].threshold = projections[middle].first;
+
+    int left = build_rp_node(forest, descriptors, begin, begin + middle, rng);
+    int right = build_rp_node(forest, descriptors, begin + middle, end, rng);
+    forest.nodes[node].left = left;
+    forest.nodes[node].right = right;
+    return node;
+}
+
+/**
+ * @brief Number of bytes held by the storage of a forest
+ */
+size_t get_rp_forest_capacity(const rp_forest_s& forest) {
+    return forest.nodes.capacity() * sizeof(rp_node_s) + forest.directions.capacity() * sizeof(float) + forest.roots.capacity() * sizeof(int)
+           + forest.order.capacity() * sizeof(int) + forest.projections.capacity() * sizeof(std::pair<float, int>);
+}
+
+/**
+ * @brief Build a forest of random projection trees over the descriptors of the samples
+ * 
+ * @param forest 
+ * @param descriptors The descriptors of the samples, DESCRIPTOR_SIZE floats each
+ * @param trees The number of trees
+ * @param prm 
+ */
+void build_rp_forest(rp_forest_s& forest, const std::vector<float>& descriptors, int trees, params prm) {
+    int nb_samples = descriptors.size() / DESCRIPTOR_SIZE;
+    size_t previous_bytes = get_rp_forest_capacity(forest);
+    // the storage of the previous forest is reused
+    forest.nodes.clear();
+    forest.directions.clear();
+    forest.roots.clear();
+    forest.order.resize((size_t)trees * nb_samples);
+    forest.projections.resize(nb_samples);
+    RNG rng(prm->seed);
+    for (int t = 0; t < trees; t++) {
+        for (int i = 0; i < nb_samples; i++) forest.order[(size_t)t * nb_samples + i] = i;
+        forest.roots.push_back(build_rp_node(forest, descriptors, t * nb_samples, (t + 1) * nb_samples, rng));
+    }
+    size_t bytes = get_rp_forest_capacity(forest);
+    if (bytes > previous_bytes) instrument_count(COUNTER_BYTES_ALLOCATED, bytes - previous_bytes);
+}
+
+/**
+ * @brief Compute the texture descriptors of the samples of a model, with their luminance remapped by 
+ * the table of their source image, and index them
+ * 
+ * @param model 
+ * @param luts The luminance remap table of each source image of the model, 256 entries each
+ * @param prm 
+ */
+void bind_texture_descriptors(source_model_s& model, const uchar * luts, params prm) {
+    int half_size = model.window_size / 2;
+    int patch_area = model.window_size * model.window_size;
+    model.descriptors.resize((size_t)model.nb_samples * DESCRIPTOR_SIZE);
+    for (int i = 0; i < model.nb_samples; i++) {
+        // the window is clamped like get_neighborhood_rect: shifted at the left and top borders
+        int width = model.patch_size[i][0];
+        compute_texture_descriptor(model.patches + (size_t)i * patch_area, width, width, model.patch_size[i][1], 
+                                   std::min(model.pos[i][0], half_size), std::min(model.pos[i][1], half_size), 
+                                   luts + 256 * model.origin[i], &model.descriptors[(size_t)i * DESCRIPTOR_SIZE]);
+    }
+    if (prm->forest_trees > 0) build_rp_forest(model.forest, model.descriptors, prm->forest_trees, prm);
+    else model.forest = rp_forest_s();
+}
+
+/**
+ * @brief Remap the model luminance to the given target distribution, then compute the neighborhood 
+ * stats of the samples and the search structures. Does nothing if the model is already bound to it.
+ * The samples of each source image are remapped with its own distribution. The search structures 
+ * depend on the remapped stats, so they are built here rather than stored in the model.
+ * 
+ * @param model 
+ * @param target_mean The mean luminance of the target
+ * @param target_stddev The luminance standard deviation of the target
+ * @param prm 
+ */
+void bind_source_model(source_model_s& model, double target_mean, double target_stddev, params prm) {
+    if (model.bound && model.target_mean == target_mean && model.target_stddev == target_stddev && model.search == prm->search 
+        && model.descriptor == prm->descriptor && model.forest_trees == (int)prm->forest_trees) return;
+    stage_timer_s timer(STAGE_LUMINANCE_REMAP);
+    // the tables are kept in the model, so binding it to another target does not allocate them again
+    model.luts.resize(256 * model.nb_origins);
+    bool identity = true;
+    for (int o = 0; o < model.nb_origins; o++) {
+        uchar * lut = &model.luts[256 * o];
+        compute_remap_lut(model.origins[o].mean, model.origins[o].stddev, target_mean, target_stddev, lut);
+        for (int l = 0; l < 256 && identity; l++) identity = lut[l] == l;
+    }
+    if (identity) {
+        for (int i = 0; i < model.nb_samples; i++) {
+            model.stats.mean[i] = model.src_stats[2 * i];
+            model.stats.stddev[i] = model.src_stats[2 * i + 1];
+        }
+    } else {
+        compute_model_stats(model, model.luts.data(), model.stats.mean, model.stats.stddev, 1);
+    }
+
+    // index the samples stats (the lookup table is built with the kd-tree)
+    model.search = prm->search;
+    if (model.search == KD_TREE || model.search == LOOKUP_TABLE)
+        build_kd_tree(model.tree, model.stats, prm);
+    if (model.search == LOOKUP_TABLE) {
+        auto start = std::chrono::steady_clock::now();
+        build_match_table(model.table, model.tree, model.stats, prm);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if (prm->verbose) printf("Lookup table (%dx%d cells) built in %.3f ms\n", model.table.mean_bins, model.table.dev_bins, elapsed.count());
+    }
+    model.descriptor = prm->descriptor;
+    model.forest_trees = prm->forest_trees;
+    if (model.descriptor == TEXTURE_DESCRIPTOR) bind_texture_descriptors(model, model.luts.data(), prm);
+    model.target_mean = target_mean;
+    model.target_stddev = target_stddev;
+    model.bound = true;
+}
+
+/**
+ * @brief Free the memory held by a source model
+ * 
+ * @param model 
+ */
+void free_source_model(source_model_s& model) {
+    free_sample_stats(model.stats);
+    std::vector<uint64_t>().swap(model.storage);
+    if (model.mapping != NULL) munmap(model.mapping, model.mapping_size);
+    model.mapping = NULL;
+    model.mapping_size = 0;
+    model.header = NULL;
+    std::vector<uchar>().swap(model.luts);
+    std::vector<float>().swap(model.descriptors);
+    model.forest = rp_forest_s();
+    model.nb_samples = 0;
+    model.bound = false;
+}
+
+/**
+ * @brief Write the data of a source model to a file, with the given hash of its source
+ * 
+ * @param model A model built by build_source_model
+ * @param path 
+ * @param source_hash 
+ * @return false if the file cannot be written
+ */
+bool save_source_model(const source_model_s& model, const char * path, uint64_t source_hash) {
+    FILE * file = fopen(path, "wb");
+    if (file == NULL) return false;
+    model_file_header_s header = *model.header;
+    header.source_hash = source_hash;
+    const uchar * data = (const uchar *) model.header;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 
+                && fwrite(data + sizeof(header), 1, header.size - sizeof(header), file) == header.size - sizeof(header);
+    return fclose(file) == 0 && written;
+}
+
+/**
+ * @brief Map a model file written by save_source_model in memory and use its data in place: nothing 
+ * is copied, the pages are only read when the model is bound
+ * 
+ * @param model 
+ * @param path 
+ * @return false if the file cannot be mapped or is not a valid model file
+ */
+bool load_source_model(source_model_s& model, const char * path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void * mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+    free_source_model(model);
+    model.mapping = mapping;
+    model.mapping_size = st.st_size;
+    if (!attach_model_data(model, mapping, st.st_size)) {
+        free_source_model(model);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Find the best matching sample of the given stats with the search structure the model is bound with
+ * 
+ * @param model 
+ * @param target_stats 
+ * @param prm 
+ * @param evaluated Incremented by the number of samples compared
+ * @return int 
+ */
+inline int find_best_match(const source_model_s& model, const Vec2d& target_stats, params prm, long& evaluated) {
+    switch (model.search) {
+        case LOOKUP_TABLE:
+            evaluated++;
+            return find_best_matching_pixel_table(model.table, target_stats);
+        case KD_TREE:
+            return find_best_matching_pixel_kd_tree(prm, model.tree, model.stats, target_stats, evaluated);
+        default:
+            evaluated += model.stats.size;
+            return find_best_matching_pixel(prm, model.stats, target_stats);
+    }
+}
+
+/**
+ * @brief Chromaticity (A and B) of the first pixel of a row of a target the colors are transferred to: 
+ * the last two channels of a LAB image (CV_8UC3) or the channels of a chromaticity image (CV_8UC2).
+ * The chromaticity of the pixel x is at [x * target.channels()] and [x * target.channels() + 1].
+ */
+inline uchar * get_chroma_row(Mat& target, int y) {
+    return target.ptr<uchar>(y) + target.channels() - 2;
+}
+
+/**
+ * @brief Find the best matching sample of each pixel of the given area of the target, and transfer
+ * its chromaticity (A and B channels).
+ * 
+ * @param model The source model, bound to the target
+ * @param target The target image in LAB color space, or its chromaticity (see get_chroma_row)
+ * @param target_stats The neighborhood stats map of the target
+ * @param area The pixels to colorise
+ * @param prm 
+ * @param mismatches Incremented by the number of lookup table matches differing from the exact search (verbose mode only)
+ */
+void transfer_color_area(const source_model_s& model, Mat& target, const Mat& target_stats, const Rect& area, params prm, long& mismatches) {
+    bool check_table = model.search == LOOKUP_TABLE && prm->verbose;
+    long evaluated = 0, check_evaluated = 0;
+    int cn = target.channels();
+    for (int y = area.y; y < area.y + area.height; y++) {
+        const Vec2d * stats_row = target_stats.ptr<Vec2d>(y);
+        uchar * chroma_row = get_chroma_row(target, y);
+        for (int x = area.x; x < area.x + area.width; x++) {
+            int match_index = find_best_match(model, stats_row[x], prm, evaluated);
+            if (check_table && match_index != find_best_matching_pixel_kd_tree(prm, model.tree, model.stats, stats_row[x], check_evaluated)) 
+                mismatches++;
+            chroma_row[x * cn] = model.chroma[match_index][0];
+            chroma_row[x * cn + 1] = model.chroma[match_index][1];
+        }
+    }
+    instrument_count(COUNTER_PIXELS_MATCHED, area.area());
+    instrument_count(COUNTER_CANDIDATES_EVALUATED, evaluated);
+}
+
+/**
+ * @brief Find the best matching pixel in the colored image of each pixel in the grayscale image,
+ * based on their neighborhood stats.
+ * The chromaticity is then transferred from the best match to the grayscale pixel (A and B channels).  
+ * The target is split in strips of TRANSFER_TILE_ROWS rows dynamically scheduled across the threads.
+ * Each pixel only depends on the stats maps, so the result does not depend on the number of threads.
+ * 
+ * @param model The source model, bound to the target
+ * @param target The target image in LAB color space, or its chromaticity (see get_chroma_row)
+ * @param target_stats The neighborhood stats map of the target
+ * @param prm 
+ */
+void transfer_color(const source_model_s& model, Mat& target, const Mat& target_stats, params prm) {
+    stage_timer_s timer(STAGE_TRANSFER_COLOR);
+    int nb_tiles = (target.rows + TRANSFER_TILE_ROWS - 1) / TRANSFER_TILE_ROWS;
+    long mismatches = 0;
+    #pragma omp parallel for num_threads(get_thread_count(prm)) schedule(dynamic) reduction(+:mismatches)
+    for (int tile = 0; tile < nb_tiles; tile++) {
+        int y = tile * TRANSFER_TILE_ROWS;
+        Rect area(0, y, target.cols, std::min(TRANSFER_TILE_ROWS, target.rows - y));
+        transfer_color_area(model, target, target_stats, area, prm, mismatches);
+    }
+    if (model.search == LOOKUP_TABLE && prm->verbose) 
+        printf("Lookup table matches differing from the exact search: %.3f%%\n", 100.0 * mismatches / target.total());
+}
+
+/**
+ * @brief Find the sample with the closest texture descriptor by comparing all of them
+ * 
+ * @param model The source model, bound with TEXTURE_DESCRIPTOR
+ * @param descriptor 
+ * @return int 
+ */
+int find_best_descriptor_linear(const source_model_s& model, const float * descriptor) {
+    float min_distance = FLT_MAX;
+    int min_index = 0;
+    for (int i = 0; i < model.nb_samples; i++) {
+        float distance = descriptor_distance(descriptor, &model.descriptors[(size_t)i * DESCRIPTOR_SIZE]);
+        if (distance < min_distance) {
+            min_distance = distance;
+            min_index = i;
+        }
+    }
+    return min_index;
+}
+
+/**
+ * @brief Find the sample with the closest texture descriptor among the samples of the leaves the 
+ * descriptor falls in, in each tree of the forest (approximate). Ties are resolved in favor of the 
+ * lowest index, like the linear search.
+ * 
+ * @param model The source model, bound with TEXTURE_DESCRIPTOR
+ * @param descriptor 
+ * @param evaluated Incremented by the number of samples compared
+ * @return int 
+ */
+int find_best_descriptor_forest(const source_model_s& model, const float * descriptor, long& evaluated) {
+    const rp_forest_s& forest = model.forest;
+    float min_distance = FLT_MAX;
+    int min_index = 0;
+    for (size_t t = 0; t < forest.roots.size(); t++) {
+        int node = forest.roots[t];
+        while (forest.nodes[node].left >= 0) {
+            const float * direction = &forest.directions[(size_t)node * DESCRIPTOR_SIZE];
+            float projection = 0.0f;
+            for (int k = 0; k < DESCRIPTOR_SIZE; k++) projection += direction[k] * descriptor[k];
+            node = projection < forest.nodes[node].threshold ? forest.nodes[node].left : forest.nodes[node].right;
+        }
+        for (int i = forest.nodes[node].begin; i < forest.nodes[node].end; i++) {
+            int j = forest.order[i];
+            float distance = descriptor_distance(descriptor, &model.descriptors[(size_t)j * DESCRIPTOR_SIZE]);
+            if (distance < min_distance || (distance == min_distance && j < min_index)) {
+                min_distance = distance;
+                min_index = j;
+            }
+        }
+        evaluated += forest.nodes[node].end - forest.nodes[node].begin;
+    }
+    return min_index;
+}
+
+/**
+ * @brief Transfer the chromaticity of the sample with the closest texture descriptor to each pixel of 
+ * the target. The samples are searched with the random projection forest of the model, or all compared 
+ * if it has no tree. In verbose mode, the recall of the forest (fraction of the pixels matched to the 
+ * same sample as the exact search, checked on one pixel out of RECALL_CHECK_STEP) and the throughput 
+ * of the search are printed.
+ * 
+ * @param model The source model, bound with TEXTURE_DESCRIPTOR
+ * @param target The target image in LAB color space, or its chromaticity (see get_chroma_row)
+ * @param luminance The luminance plane of the target (CV_8UC1)
+ * @param prm 
+ */
+void transfer_color_descriptors(const source_model_s& model, Mat& target, const Mat& luminance, params prm) {
+    stage_timer_s timer(STAGE_TRANSFER_COLOR);
+    uchar identity[256];
+    for (int l = 0; l < 256; l++) identity[l] = l;
+    bool use_forest = !model.forest.roots.empty();
+    bool check_recall = use_forest && prm->verbose;
+    long evaluated = 0, checked = 0, found = 0;
+    int cn = target.channels();
+    auto start = std::chrono::steady_clock::now();
+    #pragma omp parallel for num_threads(get_thread_count(prm)) schedule(dynamic) reduction(+:evaluated, checked, found)
+    for (int y = 0; y < target.rows; y++) {
+        uchar * chroma_row = get_chroma_row(target, y);
+        float descriptor[DESCRIPTOR_SIZE];
+        for (int x = 0; x < target.cols; x++) {
+            Rect rect = get_neighborhood_rect(luminance.size(), x, y, prm);
+            compute_texture_descriptor(luminance.ptr<uchar>(rect.y) + rect.x, luminance.step, rect.width, rect.height, 
+                                       x - rect.x, y - rect.y, identity, descriptor);
+            int match_index;
+            if (use_forest) {
+                match_index = find_best_descriptor_forest(model, descriptor, evaluated);
+            } else {
+                match_index = find_best_descriptor_linear(model, descriptor);
+                evaluated += model.nb_samples;
+            }
+            if (check_recall && ((long)y * target.cols + x) % RECALL_CHECK_STEP == 0) {
+                checked++;
+                found += match_index == find_best_descriptor_linear(model, descriptor);
+            }
+            chroma_row[x * cn] = model.chroma[match_index][0];
+            chroma_row[x * cn + 1] = model.chroma[match_index][1];
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    instrument_count(COUNTER_PIXELS_MATCHED, target.total());
+    instrument_count(COUNTER_CANDIDATES_EVALUATED, evaluated);
+    if (prm->verbose) {
+        printf("Texture descriptor search: %.2f Mpixels/s, %.1f of %d samples compared per pixel", 
+               target.total() / elapsed.count() * 1e-6, (double)evaluated / target.total(), model.nb_samples);
+        if (checked > 0) printf(", recall %.1f%% (%ld pixels checked against the exact search)", 100.0 * found / checked, checked);
+        printf("\n");
+    }
+}
+
+/**
+ * @brief Over-segment the luminance of an image in superpixels of about prm->superpixel_size pixels wide,
+ * with SLIC (Achanta et al. 2012) on the luminance and position of the pixels.
+ * Superpixel k starts at the center of the cell k of the grid of step superpixel_size, and a pixel is only
+ * compared with the superpixels of its cell and of the 8 cells around, so each pixel is assigned
+ * independently and the rows are processed in parallel.
+ * 
+ * @param luminance The luminance plane (CV_8UC1)
+ * @param prm 
+ * @param labels The superpixel of each pixel (CV_32SC1)
+ * @return int the number of superpixels
+ */
+int compute_superpixels(const Mat& luminance, params prm, Mat& labels) {
+    int step = prm->superpixel_size;
+    int grid_x = (luminance.cols + step - 1) / step;
+    int grid_y = (luminance.rows + step - 1) / step;
+    int nb_superpixels = grid_x * grid_y;
+    std::vector<Vec3d> centers(nb_superpixels); // (x, y, luminance)
+    for (int j = 0; j < grid_y; j++) {
+        for (int i = 0; i < grid_x; i++) {
+            int x = std::min(i * step + step / 2, luminance.cols - 1);
+            int y = std::min(j * step + step / 2, luminance.rows - 1);
+            centers[j * grid_x + i] = Vec3d(x, y, luminance.at<uchar>(y, x));
+        }
+    }
+
+    double spatial_weight = 1.0 / (step * step);
+    double luminance_weight = 1.0 / (SLIC_COMPACTNESS * SLIC_COMPACTNESS);
+    labels.create(luminance.size(), CV_32SC1);
+    for (int iteration = 0; iteration < SLIC_ITERATIONS; iteration++) {
+        // assign each pixel to the closest superpixel around its cell
+        #pragma omp parallel for num_threads(get_thread_count(prm))
+        for (int y = 0; y < luminance.rows; y++) {
+            const uchar * row = luminance.ptr<uchar>(y);
+            int * label_row = labels.ptr<int>(y);
+            int cj = y / step;
+            for (int x = 0; x < luminance.cols; x++) {
+                int ci = x / step;
+                double min_dist = DBL_MAX;
+                int best = cj * grid_x + ci;
+                for (int j = std::max(cj - 1, 0); j <= std::min(cj + 1, grid_y - 1); j++) {
+                    for (int i = std::max(ci - 1, 0); i <= std::min(ci + 1, grid_x - 1); i++) {
+                        const Vec3d& center = centers[j * grid_x + i];
+                        double dx = x - center[0], dy = y - center[1], dl = row[x] - center[2];
+                        double dist = (dx * dx + dy * dy) * spatial_weight + dl * dl * luminance_weight;
+                        if (dist < min_dist) {
+                            min_dist = dist;
+                            best = j * grid_x + i;
+                        }
+                    }
+                }
+                label_row[x] = best;
+            }
+        }
+
+        // move each superpixel to the centroid of its pixels
+        std::vector<Vec4d> sums(nb_superpixels, Vec4d(0, 0, 0, 0));
+        #pragma omp parallel num_threads(get_thread_count(prm))
+        {
+            std::vector<Vec4d> thread_sums(nb_superpixels, Vec4d(0, 0, 0, 0));
+            #pragma omp for
+            for (int y = 0; y < luminance.rows; y++) {
+                const uchar * row = luminance.ptr<uchar>(y);
+                const int * label_row = labels.ptr<int>(y);
+                for (int x = 0; x < luminance.cols; x++) {
+                    thread_sums[label_row[x]] += Vec4d(x, y, row[x], 1);
+                }
+            }
+            #pragma omp critical
+            for (int k = 0; k < nb_superpixels; k++) sums[k] += thread_sums[k];
+        }
+        for (int k = 0; k < nb_superpixels; k++) {
+            if (sums[k][3] > 0) centers[k] = Vec3d(sums[k][0] / sums[k][3], sums[k][1] / sums[k][3], sums[k][2] / sums[k][3]);
+        }
+    }
+    return nb_superpixels;
+}
+
+/**
+ * @brief Edge-preserving smoothing of an image guided by another one, see He et al. "Guided image filtering" (2010).
+ * 
+ * @param guide The guidance image (CV_32FC1)
+ * @param src The image to filter (CV_32FC1)
+ * @param radius The radius of the filter window
+ * @param eps The regularization, the smaller the more the edges of the guide are preserved
+ * @param dst The filtered image (CV_32FC1)
+ */
+void guided_filter(const Mat& guide, const Mat& src, int radius, double eps, Mat& dst) {
+    Size window(2 * radius + 1, 2 * radius + 1);
+    Mat mean_guide, mean_src, mean_guide_sq, mean_guide_src;
+    boxFilter(guide, mean_guide, CV_32F, window);
+    boxFilter(src, mean_src, CV_32F, window);
+    boxFilter(guide.mul(guide), mean_guide_sq, CV_32F, window);
+    boxFilter(guide.mul(src), mean_guide_src, CV_32F, window);
+    Mat variance = mean_guide_sq - mean_guide.mul(mean_guide);
+    Mat covariance = mean_guide_src - mean_guide.mul(mean_src);
+    Mat a = covariance / (variance + eps);
+    Mat b = mean_src - a.mul(mean_guide);
+    boxFilter(a, a, CV_32F, window);
+    boxFilter(b, b, CV_32F, window);
+    dst = a.mul(guide) + b;
+}
+
+/**
+ * @brief Colorise the target by superpixels: the target is over-segmented with compute_superpixels, 
+ * each superpixel is matched once with the mean neighborhood stats of its pixels, and its chromaticity is 
+ * spread to its pixels with a guided filter on the luminance, so the colors follow the edges of the target 
+ * instead of the borders of the superpixels.
+ * 
+ * @param model The source model, bound to the target
+ * @param target The target image in LAB color space, or its chromaticity (see get_chroma_row)
+ * @param target_stats The neighborhood stats map of the target
+ * @param luminance The luminance plane of the target (CV_8UC1)
+ * @param prm 
+ */
+void transfer_color_superpixels(const source_model_s& model, Mat& target, const Mat& target_stats, const Mat& luminance, params prm) {
+    stage_timer_s timer(STAGE_TRANSFER_COLOR);
+    Mat labels;
+    int nb_superpixels = compute_superpixels(luminance, prm, labels);
+
+    // mean neighborhood stats of the pixels of each superpixel
+    std::vector<Vec3d> sums(nb_superpixels, Vec3d(0, 0, 0));
+    for (int y = 0; y < target.rows; y++) {
+        const Vec2d * stats_row = target_stats.ptr<Vec2d>(y);
+        const int * label_row = labels.ptr<int>(y);
+        for (int x = 0; x < target.cols; x++) {
+            sums[label_row[x]] += Vec3d(stats_row[x][0], stats_row[x][1], 1);
+        }
+    }
+
+    std::vector<Vec2b> chroma(nb_superpixels, Vec2b(128, 128));
+    long matched = 0, evaluated = 0;
+    #pragma omp parallel for num_threads(get_thread_count(prm)) schedule(dynamic) reduction(+:matched, evaluated)
+    for (int k = 0; k < nb_superpixels; k++) {
+        if (sums[k][2] == 0) continue;
+        Vec2d stat(sums[k][0] / sums[k][2], sums[k][1] / sums[k][2]);
+        chroma[k] = model.chroma[find_best_match(model, stat, prm, evaluated)];
+        matched++;
+    }
+    instrument_count(COUNTER_PIXELS_MATCHED, matched);
+    instrument_count(COUNTER_CANDIDATES_EVALUATED, evaluated);
+
+    // piecewise constant chromaticity, smoothed along the luminance edges
+    Mat guide, channels[2];
+    luminance.convertTo(guide, CV_32F, 1.0 / 255.0);
+    for (int c = 0; c < 2; c++) {
+        channels[c].create(target.size(), CV_32FC1);
+        for (int y = 0; y < target.rows; y++) {
+            const int * label_row = labels.ptr<int>(y);
+            float * row = channels[c].ptr<float>(y);
+            for (int x = 0; x < target.cols; x++) row[x] = chroma[label_row[x]][c];
+        }
+        guided_filter(guide, channels[c], std::max((int)prm->superpixel_size / 2, 1), GUIDED_FILTER_EPS, channels[c]);
+    }
+    int cn = target.channels();
+    for (int y = 0; y < target.rows; y++) {
+        const float * a_row = channels[0].ptr<float>(y);
+        const float * b_row = channels[1].ptr<float>(y);
+        uchar * chroma_row = get_chroma_row(target, y);
+        for (int x = 0; x < target.cols; x++) {
+            chroma_row[x * cn] = saturate_cast<uchar>(a_row[x]);
+            chroma_row[x * cn + 1] = saturate_cast<uchar>(b_row[x]);
+        }
+    }
+    if (prm->verbose) printf("Superpixels: %d matches for %zu pixels\n", nb_superpixels, target.total());
+}
+
+/**
+ * @brief Remap the source model to the luminance distribution of the target, then colorise the target with it.
+ * The neighborhood stats of the target are already computed.
+ * 
+ * @param model The source model
+ * @param target The target image in LAB color space, or its chromaticity (see get_chroma_row)
+ * @param prm 
+ * @param target_stats The target neighborhood stats map
+ * @param buffers The buffers of the target stats computation
+ */
+void bind_and_transfer_stats(source_model_s& model, Mat& target, params prm, const Mat& target_stats, stat_buffers_s& buffers) {
+    Vec2d target_stat = get_image_stat(buffers);
+    bind_source_model(model, target_stat[0], target_stat[1], prm);
+    if (prm->superpixel_size > 0) transfer_color_superpixels(model, target, target_stats, buffers.luminance, prm);
+    else if (prm->descriptor == TEXTURE_DESCRIPTOR) transfer_color_descriptors(model, target, buffers.luminance, prm);
+    else transfer_color(model, target, target_stats, prm);
+}
+
+/**
+ * @brief Compute the neighborhood stats of the target, then colorise it with bind_and_transfer_stats
+ * 
+ * @param model The source model
+ * @param target The target image in LAB color space
+ * @param prm 
+ * @param target_stats Buffer of the target neighborhood stats map
+ * @param buffers Buffers of the target stats computation
+ */
+void bind_and_transfer(source_model_s& model, Mat& target, params prm, Mat& target_stats, stat_buffers_s& buffers) {
+    compute_neighborhood_stats(target, prm, target_stats, buffers);
+    bind_and_transfer_stats(model, target, prm, target_stats, buffers);
+}
+
+/**
+ * @brief Number of pyramid levels usable for an image of the given size: at most prm->pyramid_levels, 
+ * and the smallest side of the coarsest level is at least PYRAMID_MIN_SIZE pixels
+ * 
+ * @param size 
+ * @param prm 
+ * @return int 1 if the pyramid mode is off
+ */
+int get_pyramid_levels(const Size& size, params prm) {
+    int levels = 1;
+    int side = std::min(size.width, size.height);
+    while (levels < (int)prm->pyramid_levels && (side + 1) / 2 >= PYRAMID_MIN_SIZE) {
+        side = (side + 1) / 2;
+        levels++;
+    }
+    return levels;
+}
+
+/**
+ * @brief Build the source model of each level of the Gaussian pyramid of the source.
+ * The number of samples of a level is reduced if its grid would not fit the level.
+ * 
+ * @param models The models of the levels, from the finest (the source) to the coarsest
+ * @param levels The number of levels
+ * @param src The source image in LAB color space
+ * @param prm 
+ */
+void build_source_pyramid(source_model_s * models, int levels, const Mat& src, params prm) {
+    Mat level_src = src;
+    for (int level = 0; level < levels; level++) {
+        if (level > 0) pyrDown(level_src, level_src);
+        struct params_s level_prm = *prm;
+        if (prm->sampling == JITTERED) {
+            int n = std::min((int)sqrt(prm->samples), std::min(level_src.cols, level_src.rows));
+            level_prm.samples = n * n;
+        }
+        build_source_model(models[level], level_src, &level_prm);
+    }
+}
+
+/**
+ * @brief Transfer the colors of a level of the pyramid from its parent level.
+ * A pixel whose neighborhood stats differ by at most prm->pyramid_tolerance from the ones of its parent 
+ * keeps the chromaticity of its parent, the others are matched with the source model of the level.
+ * 
+ * @param model The source model of the level, bound to the level
+ * @param target The level in LAB color space
+ * @param target_stats The neighborhood stats map of the level
+ * @param parent The parent level, colorised
+ * @param parent_stats The neighborhood stats map of the parent level
+ * @param prm 
+ * @return long the number of pixels matched with the source model
+ */
+long transfer_color_from_parent(const source_model_s& model, Mat& target, const Mat& target_stats, const Mat& parent, const Mat& parent_stats, params prm) {
+    stage_timer_s timer(STAGE_TRANSFER_COLOR);
+    long searched = 0, evaluated = 0;
+    #pragma omp parallel for num_threads(get_thread_count(prm)) schedule(dynamic) reduction(+:searched, evaluated)
+    for (int y = 0; y < target.rows; y++) {
+        int py = std::min(y / 2, parent.rows - 1);
+        const Vec2d * stats_row = target_stats.ptr<Vec2d>(y);
+        const Vec2d * parent_stats_row = parent_stats.ptr<Vec2d>(py);
+        const Vec3b * parent_row = parent.ptr<Vec3b>(py);
+        Vec3b * target_row = target.ptr<Vec3b>(y);
+        for (int x = 0; x < target.cols; x++) {
+            int px = std::min(x / 2, parent.cols - 1);
+            const Vec2d& stat = stats_row[x];
+            const Vec2d& parent_stat = parent_stats_row[px];
+            if (std::abs(stat[0] - parent_stat[0]) <= prm->pyramid_tolerance && std::abs(stat[1] - parent_stat[1]) <= prm->pyramid_tolerance) {
+                target_row[x][1] = parent_row[px][1];
+                target_row[x][2] = parent_row[px][2];
+            } else {
+                int match_index = find_best_match(model, stat, prm, evaluated);
+                target_row[x][1] = model.chroma[match_index][0];
+                target_row[x][2] = model.chroma[match_index][1];
+                searched++;
+            }
+        }
+    }
+    instrument_count(COUNTER_PIXELS_MATCHED, searched);
+    instrument_count(COUNTER_CANDIDATES_EVALUATED, evaluated);
+    return searched;
+}
+
+/**
+ * @brief Coarse-to-fine colorisation: the coarsest level of the Gaussian pyramid of the target is 
+ * colorised as usual, then each finer level only searches the pixels whose neighborhood stats diverge 
+ * from the ones of their parent, and reuses the colors of the parent elsewhere.
+ * In verbose mode, the full resolution level is also colorised by the flat matching of every pixel, and the 
+ * PSNR of the result against it is printed.
+ * 
+ * @param models The source models of the levels, see build_source_pyramid
+ * @param levels The number of levels, at most the ones of the source pyramid
+ * @param target The target image in LAB color space
+ * @param prm 
+ * @param target_stats Buffer of the target neighborhood stats map
+ * @param buffers Buffers of the target stats computation
+ */
+void transfer_color_pyramid(source_model_s * models, int levels, Mat& target, params prm, Mat& target_stats, stat_buffers_s& buffers) {
+    std::vector<Mat> pyramid(levels);
+    pyramid[0] = target;
+    for (int level = 1; level < levels; level++) pyrDown(pyramid[level - 1], pyramid[level]);
+
+    Mat parent_stats;
+    for (int level = levels - 1; level >= 0; level--) {
+        compute_neighborhood_stats(pyramid[level], prm, target_stats, buffers);
+        Vec2d target_stat = get_image_stat(buffers);
+        bind_source_model(models[level], target_stat[0], target_stat[1], prm);
+        if (level == levels - 1) {
+            transfer_color(models[level], pyramid[level], target_stats, prm);
+        } else {
+            long searched = transfer_color_from_parent(models[level], pyramid[level], target_stats, pyramid[level + 1], parent_stats, prm);
+            if (prm->verbose) printf("Pyramid level %d: %.1f%% of the pixels searched\n", level, 100.0 * searched / pyramid[level].total());
+        }
+        cv::swap(target_stats, parent_stats);
+    }
+    cv::swap(target_stats, parent_stats); // leave the stats of the target in target_stats
+
+    if (prm->verbose) {
+        // pyramid_tolerance bounds the stats difference, the quality loss it causes is measured here
+        Mat flat = target.clone(), flat_bgr, target_bgr;
+        transfer_color(models[0], flat, target_stats, prm);
+        convert_color(flat, flat_bgr, COLOR_Lab2BGR);
+        convert_color(target, target_bgr, COLOR_Lab2BGR);
+        printf("Pyramid: PSNR %.2f dB against the flat matching of every pixel\n", PSNR(target_bgr, flat_bgr));
+    }
+}
+
+void sample_and_transfer(Mat& src, Mat& target, params prm) {
+    Mat target_stats;
+    stat_buffers_s buffers;
+    int levels = std::min(get_pyramid_levels(src.size(), prm), get_pyramid_levels(target.size(), prm));
+    if (levels > 1) {
+        source_model_s * models = new source_model_s[levels];
+        build_source_pyramid(models, levels, src, prm);
+        transfer_color_pyramid(models, levels, target, prm, target_stats, buffers);
+        for (int level = 0; level < levels; level++) free_source_model(models[level]);
+        delete[] models;
+        return;
+    }
+
+    // sample pixels in source image
+    source_model_s model;
+    build_source_model(model, src, prm);
+
+    // match source and target luminance histogram, then find the best color match for each grayscale pixel and transfer its color
+    bind_and_transfer(model, target, prm, target_stats, buffers);
+    free_source_model(model);
+}
+
+/**
+ * @brief 
+ * 
+ * @param target 
+ * @param x 
+ * @param y 
+ * @param sx 
+ * @param sy 
+ * @param prm 
+ * @return Vec4i 
+ */
+Vec4i get_min_neighbordhood_rect(const Mat& target, int x, int y, int sx, int sy, params prm) {
+    int half_size = prm->neighborhood_window_size / 2;
+    int ox = std::min(std::min(x, sx), half_size);
+    int oy = std::min(std::min(y, sy), half_size);
+    int sizex = std::min((int)prm->neighborhood_window_size, std::min(target.cols - (x - ox), target.cols - (sx - ox)));
+    int sizey = std::min((int)prm->neighborhood_window_size, std::min(target.rows - (y - oy), target.rows - (sy - oy)));
+    return Vec4i(ox, oy, sizex, sizey);
+}
+
+/**
+ * @brief Sum of the squared luminance differences between the window of the pixel (x, y) and the one of the sample (sx, sy).
+ * Reads the luminance plane directly, without temporaries, and accumulates on integers.
+ * The sum stops as soon as a row makes it exceed the given limit.
+ * 
+ * @param luminance The luminance plane of the target (CV_8UC1)
+ * @param rect The window (offset x, offset y, width, height) returned by get_min_neighbordhood_rect
+ * @param x 
+ * @param y 
+ * @param sx 
+ * @param sy 
+ * @param limit The sum is only exact if it is lower than or equal to this limit
+ * @return int 
+ */
+int compute_sq_diff(const Mat& luminance, const Vec4i& rect, int x, int y, int sx, int sy, int limit) {
+    int sum = 0;
+    for (int yy = 0; yy < rect[3] && sum <= limit; yy++) {
+        const uchar * gray = luminance.ptr<uchar>(y + yy - rect[1]) + x - rect[0];
+        const uchar * colored = luminance.ptr<uchar>(sy + yy - rect[1]) + sx - rect[0];
+        #pragma omp simd reduction(+:sum)
+        for (int xx = 0; xx < rect[2]; xx++) {
+            int diff = gray[xx] - colored[xx];
+            sum += diff * diff;
+        }
+    }
+    return sum;
+}
+
+/**
+ * @brief Same as compute_sq_diff, for a full window of a size known at compile time
+ * 
+ * @param luminance The luminance plane of the target (CV_8UC1)
+ * @param x 
+ * @param y 
+ * @param sx 
+ * @param sy 
+ * @param limit The sum is only exact if it is lower than or equal to this limit
+ * @return int 
+ */
+template<int W>
+int compute_window_sq_diff(const Mat& luminance, int x, int y, int sx, int sy, int limit) {
+    const int H = W / 2;
+    int sum = 0;
+    for (int yy = 0; yy < W && sum <= limit; yy++) {
+        const uchar * gray = luminance.ptr<uchar>(y + yy - H) + x - H;
+        const uchar * colored = luminance.ptr<uchar>(sy + yy - H) + sx - H;
+        for (int xx = 0; xx < W; xx++) {
+            int diff = gray[xx] - colored[xx];
+            sum += diff * diff;
+        }
+    }
+    return sum;
+}
+
+/**
+ * @brief compute_sq_diff on the full window of the window size of the kernel
+ */
+typedef int (*window_sq_diff_kernel)(const Mat&, int, int, int, int, int);
+
+/**
+ * @brief Get the SSD kernel of the window size of the parameters, or NULL if the size has no specialized kernel
+ * or prm->generic_kernels is set
+ * 
+ * @param prm 
+ * @return window_sq_diff_kernel 
+ */
+window_sq_diff_kernel get_window_sq_diff_kernel(params prm) {
+    if (prm->generic_kernels) return NULL;
+    switch (prm->neighborhood_window_size) {
+        case 3: return compute_window_sq_diff<3>;
+        case 5: return compute_window_sq_diff<5>;
+        case 7: return compute_window_sq_diff<7>;
+        case 9: return compute_window_sq_diff<9>;
+        case 11: return compute_window_sq_diff<11>;
+        default: return NULL;
+    }
+}
+
+/**
+ * @brief Computes the exact stats of a luminance window from the summed-area tables
+ * 
+ * @param sum The integral image of the luminance (CV_64F)
+ * @param sqsum The integral image of the squared luminance (CV_64F)
+ * @param rect The window
+ * @return window_stat_s 
+ */
+window_stat_s compute_window_stat(const Mat& sum, const Mat& sqsum, const Rect& rect) {
+    int x0 = rect.x, y0 = rect.y;
+    int x1 = rect.x + rect.width, y1 = rect.y + rect.height;
+    double s = sum.at<double>(y1, x1) - sum.at<double>(y0, x1) - sum.at<double>(y1, x0) + sum.at<double>(y0, x0);
+    double sq = sqsum.at<double>(y1, x1) - sqsum.at<double>(y0, x1) - sqsum.at<double>(y1, x0) + sqsum.at<double>(y0, x0);
+    window_stat_s stat;
+    stat.sum = s;
+    stat.dev = sqrt(std::max((double)rect.area() * sq - s * s, 0.0));
+    return stat;
+}
+
+/**
+ * @brief Lower bound of the SSD between two windows of n pixels, from their means and standard deviations:
+ * SSD >= n * (mean_a - mean_b)² + n * (stddev_a - stddev_b)²
+ */
+inline double sq_diff_lower_bound(const window_stat_s& a, const window_stat_s& b, int n) {
+    return ((a.sum - b.sum) * (a.sum - b.sum) + (a.dev - b.dev) * (a.dev - b.dev)) / n;
+}
+
+/**
+ * @brief Search the sample of the range [begin, end) that minimises the error distance with the pixel, 
+ * starting from the given best match. See Welsh et al. paper for the definition of the error distance.
+ * Candidates whose SSD lower bound exceeds the current best are pruned without reading their window.
+ * The candidate with the lowest bound is evaluated first to tighten the best error early, and ties are 
+ * resolved in favor of the lowest index, so searching several ranges one after another gives the match 
+ * of the exhaustive search over all of them.
+ * 
+ * @param luminance The luminance plane of the target (CV_8UC1)
+ * @param sum The integral image of the luminance
+ * @param sqsum The integral image of the squared luminance
+ * @param x The x coord of the grayscale pixel to compute the error distance from
+ * @param y The y coord of the grayscale pixel to compute the error distance from
+ * @param swatch_samples The samples of all swatches in the target image
+ * @param sample_stats The stats of the full neighborhood window of each sample
+ * @param begin The first sample of the range
+ * @param end The end of the range
+ * @param lower_bounds Scratch buffer of swatch_samples.size() elements
+ * @param kernel The SSD kernel of the full windows, see get_window_sq_diff_kernel (compute_sq_diff if NULL)
+ * @param min_error_dist The error distance of the best match, updated
+ * @param min_index The index of the best match (-1 if none), updated
+ * @param pruned Incremented by the number of candidates pruned
+ */
+void search_minimum_error_distance(const Mat& luminance, const Mat& sum, const Mat& sqsum, int x, int y, const std::vector<Vec2i>& swatch_samples, 
+                                   const std::vector<window_stat_s>& sample_stats, int begin, int end, double * lower_bounds, window_sq_diff_kernel kernel, 
+                                   params prm, int& min_error_dist, int& min_index, long& pruned) {
+    if (begin >= end) return;
+    int half_size = prm->neighborhood_window_size / 2;
+    int size = prm->neighborhood_window_size;
+    Vec4i full_rect(half_size, half_size, size, size);
+    bool interior = x >= half_size && y >= half_size && x + half_size < luminance.cols && y + half_size < luminance.rows;
+    window_stat_s pixel_stat = {0.0, 0.0};
+    if (interior) pixel_stat = compute_window_stat(sum, sqsum, Rect(x - half_size, y - half_size, size, size));
+
+    // lower bound of the error distance of each candidate 
+    int first = begin;
+    for (int j = begin; j < end; j++) {
+        const Vec2i& sample = swatch_samples[j];
+        Vec4i rect = get_min_neighbordhood_rect(luminance, x, y, sample[0], sample[1], prm);
+        if (rect == full_rect) {
+            lower_bounds[j] = sq_diff_lower_bound(pixel_stat, sample_stats[j], size * size);
+        } else {
+            window_stat_s a = compute_window_stat(sum, sqsum, Rect(x - rect[0], y - rect[1], rect[2], rect[3]));
+            window_stat_s b = compute_window_stat(sum, sqsum, Rect(sample[0] - rect[0], sample[1] - rect[1], rect[2], rect[3]));
+            lower_bounds[j] = sq_diff_lower_bound(a, b, rect[2] * rect[3]);
+        }
+        if (lower_bounds[j] < lower_bounds[first]) first = j;
+    }
+
+    for (int k = begin - 1; k < end; k++) {
+        int j = k < begin ? first : k;
+        if (k == first) continue;
+        // the distances are integers, the margin absorbs the rounding of the bound
+        if (lower_bounds[j] > min_error_dist + 0.5) {
+            pruned++;
+            continue;
+        }
+        const Vec2i& sample = swatch_samples[j];
+        Vec4i rect = get_min_neighbordhood_rect(luminance, x, y, sample[0], sample[1], prm);
+        int error_dist = kernel != NULL && rect == full_rect ? kernel(luminance, x, y, sample[0], sample[1], min_error_dist)
+                                                             : compute_sq_diff(luminance, rect, x, y, sample[0], sample[1], min_error_dist);
+        if (error_dist < min_error_dist || (error_dist == min_error_dist && min_index >= 0 && j < min_index)) {
+            min_error_dist = error_dist;
+            min_index = j;
+        }
+    }
+}
+
+/**
+ * @brief Get the coordinate of the colorised pixel (in a swatch) that minimise the error distance.
+ * See search_minimum_error_distance.
+ * 
+ * @return the index of the colorised pixel (in a swatch) that minimise the error distance
+ */
+int get_minimum_error_distance(const Mat& luminance, const Mat& sum, const Mat& sqsum, int x, int y, const std::vector<Vec2i>& swatch_samples, 
+                               const std::vector<window_stat_s>& sample_stats, double * lower_bounds, window_sq_diff_kernel kernel, params prm, long& pruned) {
+    // no initial bound: the pixel takes the best sample whatever its distance, as in a SwatchSession
+    int min_error_dist = INT_MAX; // minimum error distance between the pixel neighborhood and a colorised pixel neighborhood
+    int min_index = -1;
+    search_minimum_error_distance(luminance, sum, sqsum, x, y, swatch_samples, sample_stats, 0, swatch_samples.size(), lower_bounds, kernel, prm, 
+                                  min_error_dist, min_index, pruned);
+    return std::max(min_index, 0);
+}
+
+/**
+ * @brief Seed of the samples of a swatch, from the seed of the parameters and the swatch alone, so the 
+ * samples of a swatch do not depend on the other swatches
+ * 
+ * @param prm 
+ * @param rect The swatch in the target
+ * @return uint64_t 
+ */
+uint64_t get_swatch_seed(params prm, const Rect& rect) {
+    int32_t values[] = { (int32_t)prm->seed, rect.x, rect.y, rect.width, rect.height };
+    return fnv1a_hash(FNV_OFFSET_BASIS, values, sizeof(values));
+}
+
+/**
+ * @brief Sample a swatch of the target by jittered sampling, and compute the stats of the full 
+ * neighborhood window of the samples (only used when the window is not clamped)
+ * 
+ * @param luminance The luminance plane of the target (CV_8UC1)
+ * @param sum The integral image of the luminance
+ * @param sqsum The integral image of the squared luminance
+ * @param rect The swatch
+ * @param prm 
+ * @param rng 
+ * @param samples Receive the position of the samples in the target
+ * @param stats Receive the stats of the samples
+ */
+void sample_swatch(const Mat& luminance, const Mat& sum, const Mat& sqsum, const Rect& rect, params prm, RNG& rng, 
+                   std::vector<Vec2i>& samples, std::vector<window_stat_s>& stats) {
+    std::vector<Vec2i> neighborhood_pos;
+    jittered_sampling(rect.size(), prm, rng, neighborhood_pos);
+    int half_size = prm->neighborhood_window_size / 2;
+    int size = prm->neighborhood_window_size;
+    for (size_t j = 0; j < neighborhood_pos.size(); j++) {
+        int sx = neighborhood_pos[j][0] + rect.x, sy = neighborhood_pos[j][1] + rect.y;
+        window_stat_s stat = {0.0, 0.0};
+        if (sx >= half_size && sy >= half_size && sx + half_size < luminance.cols && sy + half_size < luminance.rows)
+            stat = compute_window_stat(sum, sqsum, Rect(sx - half_size, sy - half_size, size, size));
+        samples.push_back(Vec2i(sx, sy));
+        stats.push_back(stat);
+    }
+}
+
+/**
+ * @brief Spread the colors of the colorised swatches to the remaining pixels of the target: each pixel 
+ * takes the colors of the swatch sample whose neighborhood is the closest to its own.
+ * The target is split in tiles searched in parallel. The colors of the samples are read before the 
+ * search, so the result does not depend on the order of the tiles.
+ * 
+ * @param target The target in LAB color space, with its swatches colorised
+ * @param target_swatches The sub matrices of the swatches in the target
+ * @param target_rect The swatches in the target
+ * @param prm 
+ */
+void diffuse_color(Mat& target, std::vector<Mat>& target_swatches, const vec_swatch& target_rect, params prm) {
+    stage_timer_s timer(STAGE_DIFFUSE_COLOR);
+    // the luminance is left untouched by the swatch transfers, so it is valid for the whole diffusion
+    Mat luminance, sum, sqsum;
+    extractChannel(target, luminance, 0);
+    integral(luminance, sum, sqsum, CV_64F, CV_64F);
+
+    // get all samples from all swatches, and the stats of their neighborhood
+    std::vector<Vec2i> swatch_samples; 
+    std::vector<window_stat_s> stats;
+    Mat colorised(target.size(), CV_8UC1, Scalar(0));
+    Rect bounds(0, 0, target.cols, target.rows);
+    for (size_t i = 0; i < target_swatches.size(); i++) {
+        Rect rect = Rect(target_rect[i]) & bounds;
+        RNG rng(get_swatch_seed(prm, rect));
+        sample_swatch(luminance, sum, sqsum, rect, prm, rng, swatch_samples, stats);
+        colorised(rect).setTo(Scalar(1));
+    }
+
+    std::vector<Vec3b> sample_colors(swatch_samples.size());
+    for (size_t i = 0; i < swatch_samples.size(); i++) sample_colors[i] = target.at<Vec3b>(swatch_samples[i][1], swatch_samples[i][0]);
+
+    window_sq_diff_kernel kernel = get_window_sq_diff_kernel(prm);
+    int tiles_x = (target.cols + DIFFUSION_TILE_SIZE - 1) / DIFFUSION_TILE_SIZE;
+    int tiles_y = (target.rows + DIFFUSION_TILE_SIZE - 1) / DIFFUSION_TILE_SIZE;
+    long pruned = 0, searched_pixels = 0;
+    #pragma omp parallel num_threads(get_thread_count(prm)) reduction(+:pruned, searched_pixels)
+    {
+        std::vector<double> lower_bounds(swatch_samples.size());
+        // the uncolored regions are uneven, so the tiles are handed out one at a time
+        #pragma omp for schedule(dynamic)
+        for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+            Rect area = Rect((tile % tiles_x) * DIFFUSION_TILE_SIZE, (tile / tiles_x) * DIFFUSION_TILE_SIZE, DIFFUSION_TILE_SIZE, DIFFUSION_TILE_SIZE) 
+                      & Rect(0, 0, target.cols, target.rows);
+            for (int y = area.y; y < area.y + area.height; y++) {
+                Vec3b * target_row = target.ptr<Vec3b>(y);
+                const uchar * colorised_row = colorised.ptr<uchar>(y);
+                for (int x = area.x; x < area.x + area.width; x++) {
+                    if (colorised_row[x]) continue; // skip the pixels of the swatches, even if their colors are neutral
+                    int match_index = get_minimum_error_distance(luminance, sum, sqsum, x, y, swatch_samples, stats, lower_bounds.data(), kernel, prm, pruned);
+                    searched_pixels++;
+                    target_row[x][1] = sample_colors[match_index][1];
+                    target_row[x][2] = sample_colors[match_index][2];
+                }
+            }
+        }
+    }
+    instrument_count(COUNTER_PIXELS_MATCHED, searched_pixels);
+    instrument_count(COUNTER_CANDIDATES_EVALUATED, searched_pixels * (long)swatch_samples.size() - pruned);
+    instrument_count(COUNTER_CANDIDATES_PRUNED, pruned);
+    instrument_count(COUNTER_BYTES_ALLOCATED, luminance.total() * (2 + 2 * sizeof(double)) + swatch_samples.size() * (sizeof(Vec2i) + sizeof(window_stat_s) + sizeof(double)));
+    if (prm->verbose && searched_pixels > 0)
+        printf("Diffusion: %.2f of %zu candidates pruned per pixel\n", (double)pruned / searched_pixels, swatch_samples.size());
+}
+
+/**
+ * @brief Run the welsh colorisation algorithm
+ * 1. Convert the source (color) and target (grayscale) images to LAB color space
+ * 2. Match the source luminance histogram to the grayscale target 
+ * 3. Compute the neighborhood stats (mean, stddev) of pixels in the source image
+ * 4. For each pixel in the target, find a match in the source based on the result of step 3.
+ * 5. Transfer the colors (A,B channels) of the matching pixel to the target.
+ * 
+    cvtColor(*(colorisation->src), *(colorisation->src), COLOR_BGR2Lab);
+ * @param colorisation 
+ */
+void run(Mat& src, Mat& target, params prm) {
+    start_profiler();
+    // convert source and target images to LAB col or space
+    convert_color(src, src, COLOR_BGR2Lab);
+    convert_color(target, target, COLOR_BGR2Lab);    
+
+    sample_and_transfer(src, target, prm);
+
+    // LAB->BGR conversion
+    convert_color(target, target, COLOR_Lab2BGR);
+    stop_profiler();
+
+    if (prm->show_samples) {
+        convert_color(src, src, COLOR_Lab2BGR);
+        imwrite("samples.png", src);
+    }    
+}
+
+/**
+ * @brief Run the welsh algorithm with swatches
+ * 
+ * @param colorisation 
+ */
+void run_swatch(Mat& src, Mat& target, const vec_swatch& src_swatches, const vec_swatch& target_swatches, params prm) {
+    start_profiler();
+    // convert source and target images to LAB color space
+    convert_color(src, src, COLOR_BGR2Lab);
+    convert_color(target, target, COLOR_BGR2Lab);   
+    
+    // compute the sub matrices for each swatch
+    std::vector<Mat> src_swatch_mat, target_swatch_mat;
+    get_swatch_matrices(src, target, src_swatches, target_swatches, src_swatch_mat, target_swatch_mat);
+    
+    // apply general algo on each swatch (luminance remap + sampling + color transfer), with fewer samples.
+    // The swatches are independent tasks, each with its own copy of the parameters and of its target swatch
+    // (swatches may overlap), copied back in order. A single swatch runs alone, keeping its parallel transfer.
+    int nb_swatches = src_swatches.size();
+    struct params_s swatch_prm = *prm;
+    swatch_prm.samples = SWATCH_SAMPLES;
+    std::vector<Mat> colorised(nb_swatches);
+    #pragma omp parallel num_threads(get_thread_count(prm)) if(nb_swatches > 1)
+    #pragma omp single
+    for (int i = 0; i < nb_swatches; i++) {
+        #pragma omp task firstprivate(i, swatch_prm) shared(src_swatch_mat, target_swatch_mat, colorised)
+        {
+            colorised[i] = target_swatch_mat[i].clone();
+            sample_and_transfer(src_swatch_mat[i], colorised[i], &swatch_prm);
+        }
+    }
+    for (int i = 0; i < nb_swatches; i++) colorised[i].copyTo(target_swatch_mat[i]);
+
+    diffuse_color(target, target_swatch_mat, target_swatches, &swatch_prm);
+
+    // LAB->BGR conversion
+    convert_color(target, target, COLOR_Lab2BGR);    
+    stop_profiler();
+}
+
+/**
+ * @brief Frames of a video file or of a directory of images, read in order
+ */
+struct frame_reader_s {
+    VideoCapture capture;           // opened if the input is a video file
+    std::vector<String> files;      // image files if the input is a directory, sorted by name
+    size_t next_file;               // index of the next file to read
+};
+
+/**
+ * @brief Open a video file or a directory of images
+ * 
+ * @param reader 
+ * @param input The path of the video file or directory 
+ * @return true if the input is a directory 
+ */
+bool open_frame_reader(frame_reader_s& reader, const char * input) {
+    struct stat info;
+    bool is_directory = stat(input, &info) == 0 && S_ISDIR(info.st_mode);
+    reader.next_file = 0;
+    if (is_directory) {
+        glob(String(input) + "/*", reader.files, false);
+        std::sort(reader.files.begin(), reader.files.end());
+    } else {
+        exit_if(!reader.capture.open(input), "Cannot open the input video");
+    }
+    return is_directory;
+}
+
+/**
+ * @brief Read the next frame
+ * 
+ * @param reader 
+ * @param frame The frame read
+ * @param name The file name of the frame, if the input is a directory
+ * @return false if there is no frame left
+ */
+bool read_frame(frame_reader_s& reader, Mat& frame, String& name) {
+    if (reader.capture.isOpened()) return reader.capture.read(frame);
+    while (reader.next_file < reader.files.size()) {
+        name = reader.files[reader.next_file++];
+        frame = imread(name);
+        if (!frame.empty()) {
+            name = name.substr(name.find_last_of('/') + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Check if the luminance of a tile changed from the previous frame.
+ * The tile is extended by window size - 1 pixels, the reach of the (clamped) neighborhood windows of its pixels.
+ * 
+ * @param luminance The luminance of the current frame
+ * @param previous The luminance of the previous frame
+ * @param tile 
+ * @param prm 
+ * @return true if a pixel of the extended tile differs by more than prm->sequence_tolerance 
+ */
+bool tile_changed(const Mat& luminance, const Mat& previous, const Rect& tile, params prm) {
+    int halo = prm->neighborhood_window_size - 1;
+    Rect extended = Rect(tile.x - halo, tile.y - halo, tile.width + 2 * halo, tile.height + 2 * halo) & Rect(0, 0, luminance.cols, luminance.rows);
+    for (int y = extended.y; y < extended.y + extended.height; y++) {
+        const uchar * current_row = luminance.ptr<uchar>(y);
+        const uchar * previous_row = previous.ptr<uchar>(y);
+        for (int x = extended.x; x < extended.x + extended.width; x++) {
+            if (std::abs(current_row[x] - previous_row[x]) > prm->sequence_tolerance) return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Copy the A and B channels of the given area from an image to another
+ * 
+ * @param src The LAB image to copy the chromaticity from
+ * @param dst The LAB image to copy the chromaticity to
+ * @param area 
+ */
+void copy_chroma(const Mat& src, Mat& dst, const Rect& area) {
+    for (int y = area.y; y < area.y + area.height; y++) {
+        const Vec3b * src_row = src.ptr<Vec3b>(y);
+        Vec3b * dst_row = dst.ptr<Vec3b>(y);
+        for (int x = area.x; x < area.x + area.width; x++) {
+            dst_row[x][1] = src_row[x][1];
+            dst_row[x][2] = src_row[x][2];
+        }
+    }
+}
+
+/**
+ * @brief Run the welsh colorisation algorithm on each frame of a sequence.
+ * The source model is built once, and remapped to the luminance distribution of the first frame
+ * for the whole sequence, so the colors of a static scene stay stable. 
+ * The matches of the tiles whose luminance did not change from the previous frame are reused.
+ * 
+ * @param src The source image
+ * @param input The path of the grayscale video file or directory of frames
+ * @param output The path of the result video file, or directory if the input is a directory
+ * @param prm 
+ * @param report The frame rate and the tile reuse of the run, may be NULL
+ */
+void run_sequence(Mat& src, const char * input, const char * output, params prm, sequence_report_s * report) {
+    auto start = std::chrono::steady_clock::now();
+    frame_reader_s reader;
+    bool is_directory = open_frame_reader(reader, input);
+    double fps = is_directory ? 25.0 : reader.capture.get(CAP_PROP_FPS);
+    VideoWriter writer;
+
+    // the frames are read and written between their colorisation, so the whole loop is profiled
+    start_profiler();
+    convert_color(src, src, COLOR_BGR2Lab);
+    source_model_s model;
+    build_source_model(model, src, prm);
+
+    Mat frame, lab, luminance, previous_luminance, previous_lab, target_stats;
+    stat_buffers_s buffers;
+    String name;
+    int frames = 0;
+    long tiles = 0, reused_tiles = 0;
+    std::vector<Rect> changed;
+    while (read_frame(reader, frame, name)) {
+        convert_color(frame, lab, COLOR_BGR2Lab);
+        compute_neighborhood_stats(lab, prm, target_stats, buffers);
+        buffers.luminance.copyTo(luminance);
+        if (frames == 0) {
+            Vec2d target_stat = get_image_stat(buffers);
+            bind_source_model(model, target_stat[0], target_stat[1], prm);
+        }
+        bool same_size = frames > 0 && luminance.size() == previous_luminance.size();
+
+        // reuse the colors of the unchanged tiles, and list the others
+        changed.clear();
+        for (int y = 0; y < lab.rows; y += SEQUENCE_TILE_SIZE) {
+            for (int x = 0; x < lab.cols; x += SEQUENCE_TILE_SIZE) {
+                Rect tile(x, y, std::min(SEQUENCE_TILE_SIZE, lab.cols - x), std::min(SEQUENCE_TILE_SIZE, lab.rows - y));
+                tiles++;
+                if (same_size && !tile_changed(luminance, previous_luminance, tile, prm)) {
+                    copy_chroma(previous_lab, lab, tile);
+                    // keep comparing with the luminance the tile was matched with, so changes below the tolerance do not add up
+                    previous_luminance(tile).copyTo(luminance(tile));
+                    reused_tiles++;
+                } else {
+                    changed.push_back(tile);
+                }
+            }
+        }
+
+        long mismatches = 0;
+        #pragma omp parallel for num_threads(get_thread_count(prm)) schedule(dynamic) reduction(+:mismatches)
+        for (size_t i = 0; i < changed.size(); i++) {
+            transfer_color_area(model, lab, target_stats, changed[i], prm, mismatches);
+        }
+
+        cv::swap(luminance, previous_luminance);
+        cv::swap(lab, previous_lab);
+        convert_color(previous_lab, frame, COLOR_Lab2BGR);
+        if (is_directory) {
+            imwrite(String(output) + "/" + name, frame);
+        } else {
+            if (!writer.isOpened()) {
+                String path(output);
+                bool avi = path.size() > 4 && path.compare(path.size() - 4, 4, ".avi") == 0;
+                int fourcc = avi ? VideoWriter::fourcc('M', 'J', 'P', 'G') : VideoWriter::fourcc('m', 'p', '4', 'v');
+                exit_if(!writer.open(output, fourcc, fps > 0 ? fps : 25.0, frame.size()), "Cannot open the output video");
+            }
+            writer.write(frame);
+        }
+        frames++;
+    }
+    stop_profiler();
+    free_source_model(model);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (report != NULL) {
+        report->frames = frames;
+        report->seconds = elapsed.count();
+        report->frames_per_second = frames / elapsed.count();
+        report->reused_tiles = tiles > 0 ? (double)reused_tiles / tiles : 0.0;
+    }
+}
+
+/**
+ * @brief Blocking FIFO queue of bounded capacity, connecting two stages of the batch pipeline.
+ * Records its occupancy each time an item is pushed.
+ */
+template <typename T>
+class bounded_queue {
+public:
+    explicit bounded_queue(size_t capacity) : capacity(capacity), closed(false), occupancy_sum(0), pushes(0) {}
+
+    /**
+     * @brief Push an item, waiting while the queue is full
+     */
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        occupancy_sum += items.size();
+        pushes++;
+        not_empty.notify_one();
+    }
+
+    /**
+     * @brief Pop an item, waiting while the queue is empty
+     * 
+     * @return false if the queue is empty and closed 
+     */
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Signal that no more items will be pushed
+     */
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+    /**
+     * @brief Mean occupancy of the queue, as a fraction of its capacity
+     */
+    double mean_occupancy() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pushes > 0 ? (double)occupancy_sum / pushes / capacity : 0.0;
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    size_t occupancy_sum;           // sum of the queue sizes after each push
+    size_t pushes;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+/**
+ * @brief Image travelling through the batch pipeline
+ */
+struct batch_item_s {
+    String name;        // file name of the target, also used for the result
+    Mat image;          // decoded target, then colorised result
+};
+
+/**
+ * @brief Colorise a list of grayscale images with the same source image, in a three-stage pipeline:
+ * a thread decodes the targets, the calling thread colorises them (in parallel with OpenMP) and 
+ * a thread encodes the results. The stages are connected by bounded queues, so the I/O of some 
+ * images overlaps with the colorisation of others. 
+ * The source model is built once, and only remapped to the luminance distribution of each target.
+ * 
+ * @param src The source image
+ * @param target_paths The paths of the grayscale images
+ * @param output_dir The directory of the result images
+ * @param prm 
+ * @param report The throughput and queue occupancy of the run, may be NULL
+ */
+void run_batch(Mat& src, const std::vector<String>& target_paths, const char * output_dir, params prm, batch_report_s * report) {
+    auto start = std::chrono::steady_clock::now();
+    convert_color(src, src, COLOR_BGR2Lab);
+    source_model_s model;
+    build_source_model(model, src, prm);
+
+    bounded_queue<batch_item_s> decoded(BATCH_QUEUE_CAPACITY), colorised(BATCH_QUEUE_CAPACITY);
+    int failures = 0;
+    std::thread decoder([&] {
+        for (size_t i = 0; i < target_paths.size(); i++) {
+            batch_item_s item;
+            item.image = imread(target_paths[i]);
+            if (item.image.empty()) {
+                log_error(("Cannot load target image " + target_paths[i]).c_str());
+                continue;
+            }
+            item.name = target_paths[i].substr(target_paths[i].find_last_of('/') + 1);
+            decoded.push(std::move(item));
+        }
+        decoded.close();
+    });
+    std::thread encoder([&] {
+        batch_item_s item;
+        while (colorised.pop(item)) {
+            if (!imwrite(String(output_dir) + "/" + item.name, item.image)) {
+                log_error(("Cannot write result image " + item.name).c_str());
+                failures++;
+            }
+        }
+    });
+
+    int images = 0;
+    batch_item_s item;
+    Mat target_stats;
+    stat_buffers_s buffers;
+    start_profiler();
+    while (decoded.pop(item)) {
+        convert_color(item.image, item.image, COLOR_BGR2Lab);
+        bind_and_transfer(model, item.image, prm, target_stats, buffers);
+        convert_color(item.image, item.image, COLOR_Lab2BGR);
+        colorised.push(std::move(item));
+        images++;
+    }
+    stop_profiler();
+    colorised.close();
+    decoder.join();
+    encoder.join();
+    free_source_model(model);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (report != NULL) {
+        report->images = images - failures;
+        report->seconds = elapsed.count();
+        report->images_per_second = report->images / elapsed.count();
+        report->decoded_queue_occupancy = decoded.mean_occupancy();
+        report->colorised_queue_occupancy = colorised.mean_occupancy();
+    }
+}
+
+/**
+ * @brief Binary PNM image (P5 grayscale or P6 RGB, 8 bits), read or written by rows
+ */
+struct pnm_file_s {
+    int fd;
+    int width;
+    int height;
+    int channels;           // 1 (P5) or 3 (P6)
+    off_t data_offset;      // offset of the first row in the file
+};
+
+/**
+ * @brief Parse the header of a binary PNM image opened by open_pnm
+ * 
+ * @param pnm 
+ * @return false if the file is not an 8 bits P5 or P6 image
+ */
+bool read_pnm_header(pnm_file_s& pnm) {
+    char header[PNM_MAX_HEADER_SIZE + 1];
+    ssize_t size = pread(pnm.fd, header, PNM_MAX_HEADER_SIZE, 0);
+    if (size < 2 || header[0] != 'P' || (header[1] != '5' && header[1] != '6')) return false;
+    header[size] = '\0';
+    pnm.channels = header[1] == '5' ? 1 : 3;
+
+    // width, height and maximum value, separated by whitespaces and comments
+    int values[3];
+    ssize_t pos = 2;
+    for (int i = 0; i < 3; i++) {
+        while (pos < size && (isspace(header[pos]) || header[pos] == '#')) {
+            if (header[pos] == '#') while (pos < size && header[pos] != '\n') pos++;
+            else pos++;
+        }
+        if (pos >= size || !isdigit(header[pos])) return false;
+        values[i] = atoi(header + pos);
+        while (pos < size && isdigit(header[pos])) pos++;
+    }
+    pnm.width = values[0];
+    pnm.height = values[1];
+    pnm.data_offset = pos + 1; // a single whitespace ends the header
+    return values[2] == 255 && pnm.width > 0 && pnm.height > 0 && pos < size;
+}
+
+/**
+ * @brief Open a binary PNM image and parse its header
+ * 
+ * @param pnm 
+ * @param path 
+ * @return false if the file cannot be opened, or is not an 8 bits P5 or P6 image (the file is then closed)
+ */
+bool open_pnm(pnm_file_s& pnm, const char * path) {
+    pnm.fd = open(path, O_RDONLY);
+    if (pnm.fd < 0) return false;
+    if (read_pnm_header(pnm)) return true;
+    close(pnm.fd);
+    pnm.fd = -1;
+    return false;
+}
+
+/**
+ * @brief Create a binary PPM image of the given size, written later by rows with write_ppm_rows
+ * 
+ * @param pnm 
+ * @param path 
+ * @param width 
+ * @param height 
+ * @return false if the file cannot be created (it is then closed)
+ */
+bool create_ppm(pnm_file_s& pnm, const char * path, int width, int height) {
+    pnm.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (pnm.fd < 0) return false;
+    char header[PNM_MAX_HEADER_SIZE];
+    int size = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+    pnm.width = width;
+    pnm.height = height;
+    pnm.channels = 3;
+    pnm.data_offset = size;
+    if (write(pnm.fd, header, size) == size && ftruncate(pnm.fd, pnm.data_offset + (off_t)width * height * 3) == 0) return true;
+    close(pnm.fd);
+    pnm.fd = -1;
+    return false;
+}
+
+/**
+ * @brief Read the given rows of a PNM image as an RGB matrix.
+ * Uses pread, so several threads can read the same file at once.
+ * 
+ * @param pnm 
+ * @param y The first row
+ * @param rows The number of rows
+ * @param raw Buffer of the rows as stored in the file
+ * @param rgb The rows (CV_8UC3)
+ * @return false if the rows cannot be read
+ */
+bool read_pnm_rows(const pnm_file_s& pnm, int y, int rows, Mat& raw, Mat& rgb) {
+    raw.create(rows, pnm.width, CV_8UC(pnm.channels));
+    size_t size = raw.total() * raw.elemSize();
+    off_t offset = pnm.data_offset + (off_t)y * pnm.width * pnm.channels;
+    if (pread(pnm.fd, raw.data, size, offset) != (ssize_t)size) return false;
+    if (pnm.channels == 1) cvtColor(raw, rgb, COLOR_GRAY2RGB);
+    else raw.copyTo(rgb);
+    return true;
+}
+
+/**
+ * @brief Write the given RGB rows to a PPM image created with create_ppm
+ * 
+ * @param pnm 
+ * @param y The first row
+ * @param rgb The rows (CV_8UC3, continuous)
+ * @return false if the rows cannot be written
+ */
+bool write_ppm_rows(const pnm_file_s& pnm, int y, const Mat& rgb) {
+    size_t size = rgb.total() * rgb.elemSize();
+    off_t offset = pnm.data_offset + (off_t)y * pnm.width * 3;
+    return pwrite(pnm.fd, rgb.data, size, offset) == (ssize_t)size;
+}
+
+/**
+ * @brief Computes the neighborhood stats of the given rows of an image, of which only a block of rows is loaded.
+ * The neighborhoods are clamped to the borders of the whole image, so the stats are the ones
+ * compute_neighborhood_stats gives on the whole image: the sums of the integral images are exact integers 
+ * whatever their origin. The block must include the neighborhood_window_size / 2 rows around the given ones.
+ * 
+ * @param block The loaded rows in LAB color space
+ * @param block_y The row of the image of the first row of the block
+ * @param image_size The size of the whole image
+ * @param y The first row to compute the stats of
+ * @param rows The number of rows to compute the stats of
+ * @param prm 
+ * @param stats The resulting map (CV_64FC2), of the given rows only
+ * @param buffers 
+ */
+void compute_strip_stats(const Mat& block, int block_y, const Size& image_size, int y, int rows, params prm, Mat& stats, stat_buffers_s& buffers) {
+    stage_timer_s timer(STAGE_NEIGHBORHOOD_STATS);
+    extractChannel(block, buffers.luminance, 0);
+    integral(buffers.luminance, buffers.sum, buffers.sqsum, CV_64F, CV_64F);
+    stats.create(rows, block.cols, CV_64FC2);
+    for (int r = 0; r < rows; r++) {
+        Vec2d * row = stats.ptr<Vec2d>(r);
+        for (int x = 0; x < block.cols; x++) {
+            Rect rect = get_neighborhood_rect(image_size, x, y + r, prm);
+            rect.y -= block_y;
+            row[x] = compute_rect_stat(buffers.sum, buffers.sqsum, rect);
+        }
+    }
+}
+
+/**
+ * @brief Colorise a PNM target too large to be loaded, strip by strip.
+ * A first pass sums the luminance of the strips to get the distribution of the whole target, which the 
+ * source model is remapped to. The second pass loads each strip with a halo of neighborhood_window_size / 2 
+ * rows, colorises it and writes it to the result. The strips are processed in parallel, each thread 
+ * reusing its own buffers, so the memory used depends on the strip height and the number of threads, not 
+ * on the height of the target. Every pixel only depends on the global distribution and on its neighborhood,
+ * so the result is the one of a whole-image run, without seams.
+ * 
+ * @param src The source image
+ * @param target_path The path of the target (binary PGM or PPM)
+ * @param output_path The path of the result (binary PPM)
+ * @param prm 
+ * @throw ColorisationError if the target cannot be read or the result cannot be written
+ */
+void run_streaming(Mat& src, const char * target_path, const char * output_path, params prm) {
+    pnm_file_s target, output;
+    if (!open_pnm(target, target_path)) 
+        throw ColorisationError("cannot open the target image (8 bits binary PGM or PPM expected)");
+    if (!create_ppm(output, output_path, target.width, target.height)) {
+        close(target.fd);
+        throw ColorisationError("cannot create the result image");
+    }
+    Size image_size(target.width, target.height);
+    int strip_rows = std::max((int)prm->strip_rows, 1);
+    int nb_strips = (target.height + strip_rows - 1) / strip_rows;
+    int halo = prm->neighborhood_window_size / 2;
+
+    start_profiler();
+    convert_color(src, src, COLOR_BGR2Lab);
+    source_model_s model;
+    build_source_model(model, src, prm);
+
+    // an I/O error skips the remaining strips, and is raised once the threads are done
+    std::atomic<bool> failed(false);
+
+    // luminance distribution of the whole target, summed on integers so it does not depend on the strips
+    long long sum = 0, sqsum = 0;
+    #pragma omp parallel num_threads(get_thread_count(prm)) reduction(+:sum, sqsum)
+    {
+        Mat raw, rgb, lab, luminance;
+        #pragma omp for schedule(dynamic)
+        for (int strip = 0; strip < nb_strips; strip++) {
+            if (failed) continue;
+            int y = strip * strip_rows;
+            if (!read_pnm_rows(target, y, std::min(strip_rows, target.height - y), raw, rgb)) {
+                failed = true;
+                continue;
+            }
+            convert_color(rgb, lab, COLOR_RGB2Lab);
+            extractChannel(lab, luminance, 0);
+            for (int r = 0; r < luminance.rows; r++) {
+                const uchar * row = luminance.ptr<uchar>(r);
+                for (int x = 0; x < luminance.cols; x++) {
+                    sum += row[x];
+                    sqsum += row[x] * row[x];
+                }
+            }
+        }
+    }
+    // same formula as compute_rect_stat on the whole image
+    // the area is computed in double: a gigapixel target overflows the int of Size::area
+    double scale = 1.0 / ((double)target.width * target.height);
+    double target_mean = (double)sum * scale;
+    double target_stddev = sqrt(std::max((double)sqsum * scale - target_mean * target_mean, 0.0));
+    if (!failed) bind_source_model(model, target_mean, target_stddev, prm);
+
+    #pragma omp parallel num_threads(get_thread_count(prm))
+    {
+        Mat raw, rgb, lab, strip_stats, result;
+        stat_buffers_s buffers;
+        #pragma omp for schedule(dynamic)
+        for (int strip = 0; strip < nb_strips; strip++) {
+            if (failed) continue;
+            int y = strip * strip_rows;
+            int rows = std::min(strip_rows, target.height - y);
+            int block_y = std::max(y - halo, 0);
+            int block_rows = std::min(y + rows + halo, target.height) - block_y;
+            if (!read_pnm_rows(target, block_y, block_rows, raw, rgb)) {
+                failed = true;
+                continue;
+            }
+            convert_color(rgb, lab, COLOR_RGB2Lab);
+            compute_strip_stats(lab, block_y, image_size, y, rows, prm, strip_stats, buffers);
+
+            Mat strip_lab = lab.rowRange(y - block_y, y - block_y + rows);
+            long mismatches = 0;
+            transfer_color_area(model, strip_lab, strip_stats, Rect(0, 0, target.width, rows), prm, mismatches);
+            convert_color(strip_lab, result, COLOR_Lab2RGB);
+            if (!write_ppm_rows(output, y, result)) failed = true;
+        }
+    }
+    stop_profiler();
+    free_source_model(model);
+    close(target.fd);
+    bool closed = close(output.fd) == 0;
+    if (failed || !closed) throw ColorisationError("cannot read the target image or write the result image");
+}
+
+///////////////////
+// API FUNCTIONS //
 ///////////////////
-// API FUNCTIONS //
-///////////////////
+
+/**
+ * @brief Copy the parameters given to an API function, or the default ones if it got NULL
+ * 
+ * @param prm The parameters, or NULL
+ * @return struct params_s 
+ */
+struct params_s resolve_params(params prm) {
+    if (prm != NULL) return *prm;
+    params defaults = create_default_params();
+    struct params_s resolved = *defaults;
+    free(defaults);
+    return resolved;
+}
+
+void welsh_colorisation_references(const std::vector<Mat>& source_imgs, Mat& target_img, const char * dst_img, params prm) {
+    struct params_s resolved_prm = resolve_params(prm);
+    prm = &resolved_prm;
+    exit_if(source_imgs.empty(), "Error: no source image");
+    start_profiler();
+    std::vector<Mat> sources(source_imgs.size());
+    for (size_t i = 0; i < source_imgs.size(); i++) convert_color(source_imgs[i], sources[i], COLOR_BGR2Lab);
+    convert_color(target_img, target_img, COLOR_BGR2Lab);
+
+    // every pixel is matched once against the samples of all the sources
+    source_model_s model;
+    Mat target_stats;
+    stat_buffers_s buffers;
+    build_merged_source_model(model, sources, prm);
+    bind_and_transfer(model, target_img, prm, target_stats, buffers);
+    free_source_model(model);
+
+    convert_color(target_img, target_img, COLOR_Lab2BGR);
+    stop_profiler();
+    imwrite(dst_img, target_img);
+}
+
+/**
+ * @brief Parse a whole value of the parameters file as an integer within [min, max]
+ * 
+ * @param value 
+ * @param min 
+ * @param max 
+ * @param base The base of strtoll (0 to accept the 0x and 0 prefixes)
+ * @param result Receive the integer
+ * @return true if the value is an integer within the bounds, with nothing after it
+ */
+bool parse_params_integer(const char * value, long long min, long long max, int base, long long& result) {
+    char * end;
+    errno = 0;
+    result = strtoll(value, &end, base);
+    return end != value && *end == '\0' && errno == 0 && result >= min && result <= max;
+}
+
+bool parse_params_value(const char * value, uint& result, int base = 10) {
+    long long integer;
+    if (!parse_params_integer(value, 0, UINT_MAX, base, integer)) return false;
+    result = (uint) integer;
+    return true;
+}
+
+bool parse_params_value(const char * value, int& result) {
+    long long integer;
+    if (!parse_params_integer(value, INT_MIN, INT_MAX, 10, integer)) return false;
+    result = (int) integer;
+    return true;
+}
+
+bool parse_params_value(const char * value, double& result) {
+    char * end;
+    errno = 0;
+    result = strtod(value, &end);
+    return end != value && *end == '\0' && errno == 0;
+}
+
+bool read_params_file(const char * path, params prm) {
+    FILE * file = fopen(path, "r");
+    if (file == NULL) {
+        log_error("cannot open the parameters file");
+        return false;
+    }
+    char line[PARAMS_FILE_MAX_LINE], key[64], value[64];
+    bool valid = true;
+    while (valid && fgets(line, sizeof(line), file) != NULL) {
+        char * start = line;
+        while (isspace((uchar)*start)) start++;
+        if (*start == '\0' || *start == '#') continue;
+        if (sscanf(start, "%63[^= \t] = %63s", key, value) != 2) {
+            valid = false;
+        } else if (strcmp(key, "window_size") == 0) {
+            valid = parse_params_value(value, prm->neighborhood_window_size);
+        } else if (strcmp(key, "samples") == 0) {
+            valid = parse_params_value(value, prm->samples);
+        } else if (strcmp(key, "sampling") == 0) {
+            if (strcmp(value, "jittered") == 0) prm->sampling = JITTERED;
+            else if (strcmp(value, "brute_force") == 0) prm->sampling = BRUTE_FORCE;
+            else valid = false;
+        } else if (strcmp(key, "search") == 0) {
+            if (strcmp(value, "kdtree") == 0) prm->search = KD_TREE;
+            else if (strcmp(value, "linear") == 0) prm->search = LINEAR_SEARCH;
+            else if (strcmp(value, "lut") == 0) prm->search = LOOKUP_TABLE;
+            else valid = false;
+        } else if (strcmp(key, "lut_resolution") == 0) {
+            valid = parse_params_value(value, prm->lut_resolution);
+        } else if (strcmp(key, "mean_weight") == 0) {
+            valid = parse_params_value(value, prm->mean_weight);
+        } else if (strcmp(key, "threads") == 0) {
+            valid = parse_params_value(value, prm->threads);
+        } else if (strcmp(key, "seed") == 0) {
+            valid = parse_params_value(value, prm->seed, 0);
+        } else if (strcmp(key, "pyramid_levels") == 0) {
+            valid = parse_params_value(value, prm->pyramid_levels);
+        } else if (strcmp(key, "pyramid_tolerance") == 0) {
+            valid = parse_params_value(value, prm->pyramid_tolerance);
+        } else if (strcmp(key, "superpixel_size") == 0) {
+            valid = parse_params_value(value, prm->superpixel_size);
+        } else if (strcmp(key, "descriptor") == 0) {
+            if (strcmp(value, "stats") == 0) prm->descriptor = STATS_DESCRIPTOR;
+            else if (strcmp(value, "texture") == 0) prm->descriptor = TEXTURE_DESCRIPTOR;
+            else valid = false;
+        } else if (strcmp(key, "forest_trees") == 0) {
+            valid = parse_params_value(value, prm->forest_trees);
+        } else if (strcmp(key, "strip_rows") == 0) {
+            valid = parse_params_value(value, prm->strip_rows);
+        } else if (strcmp(key, "sequence_tolerance") == 0) {
+            valid = parse_params_value(value, prm->sequence_tolerance);
+        } else {
+            valid = false;
+        }
+    }
+    fclose(file);
+    line[strcspn(line, "\n")] = '\0';
+    if (!valid) log_error(format("invalid line in the parameters file: %s", line).c_str());
+    return valid;
+}
+
+bool write_params_file(const char * path, params prm) {
+    FILE * file = fopen(path, "w");
+    if (file == NULL) {
+        log_error("cannot write the parameters file");
+        return false;
+    }
+    const char * search = prm->search == LINEAR_SEARCH ? "linear" : prm->search == LOOKUP_TABLE ? "lut" : "kdtree";
+    fprintf(file, "# colorisation parameters\n");
+    fprintf(file, "window_size = %u\n", prm->neighborhood_window_size);
+    fprintf(file, "samples = %u\n", prm->samples);
+    fprintf(file, "sampling = %s\n", prm->sampling == BRUTE_FORCE ? "brute_force" : "jittered");
+    fprintf(file, "search = %s\n", search);
+    fprintf(file, "lut_resolution = %.17g\n", prm->lut_resolution);
+    fprintf(file, "mean_weight = %.17g\n", prm->mean_weight);
+    fprintf(file, "threads = %u\n", prm->threads);
+    fprintf(file, "seed = %u\n", prm->seed);
+    fprintf(file, "pyramid_levels = %u\n", prm->pyramid_levels);
+    fprintf(file, "pyramid_tolerance = %.17g\n", prm->pyramid_tolerance);
+    fprintf(file, "superpixel_size = %u\n", prm->superpixel_size);
+    fprintf(file, "descriptor = %s\n", prm->descriptor == TEXTURE_DESCRIPTOR ? "texture" : "stats");
+    fprintf(file, "forest_trees = %u\n", prm->forest_trees);
+    fprintf(file, "strip_rows = %u\n", prm->strip_rows);
+    fprintf(file, "sequence_tolerance = %d\n", prm->sequence_tolerance);
+    return fclose(file) == 0;
+}
+
+void welsh_autotune(const Mat& reference, const Mat& target, const Mat& truth, params prm, std::vector<autotune_result_s>& results) {
+    static const uint samples[] = { 64, 128, 256, 512, 1024 };
+    static const uint windows[] = { 3, 5, 7, 9 };
+    static const sampling_method samplings[] = { JITTERED, BRUTE_FORCE };
+    std::vector<uint> threads(1, 1);
+    if (omp_get_max_threads() > 1) threads.push_back(omp_get_max_threads());
+
+    // without ground truth, the quality is the one of the reference colorised from its own luminance
+    if (!truth.empty() && (truth.size() != target.size() || truth.type() != CV_8UC3))
+        throw ColorisationError("the ground truth must be a BGR image of the size of the target");
+    // the gray of the reference gets its own buffer: the target of the caller is left untouched
+    Mat quality_target, quality_truth = truth;
+    if (truth.empty()) {
+        convert_color(reference, quality_target, COLOR_BGR2GRAY);
+        quality_truth = reference;
+    }
+
+    results.clear();
+    for (size_t s = 0; s < sizeof(samples) / sizeof(samples[0]); s++) {
+        for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+            for (size_t m = 0; m < sizeof(samplings) / sizeof(samplings[0]); m++) {
+                for (size_t t = 0; t < threads.size(); t++) {
+                    autotune_result_s result;
+                    result.prm = *prm;
+                    result.prm.samples = samples[s];
+                    result.prm.neighborhood_window_size = windows[w];
+                    result.prm.sampling = samplings[m];
+                    result.prm.threads = threads[t];
+                    result.pareto = false;
+                    Mat dst;
+                    try {
+                        // run time of the whole colorisation (sampling included), best of the repeats
+                        result.milliseconds = DBL_MAX;
+                        for (int r = 0; r < AUTOTUNE_REPEATS; r++) {
+                            auto start = std::chrono::steady_clock::now();
+                            Colorizer colorizer(reference, result.prm);
+                            colorizer.colorise(target, dst);
+                            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                            result.milliseconds = std::min(result.milliseconds, elapsed.count());
+                        }
+                        if (truth.empty()) {
+                            Colorizer colorizer(reference, result.prm);
+                            colorizer.colorise(quality_target, dst);
+                        }
+                    } catch (const ColorisationError& e) {
+                        continue; // too many samples for the reference
+                    }
+                    result.psnr = PSNR(quality_truth, dst);
+                    results.push_back(result);
+                    if (prm->verbose) 
+                        printf("samples %u, window %u, %s, %u threads: %.2f dB in %.2f ms\n", samples[s], windows[w], 
+                               samplings[m] == JITTERED ? "jittered" : "brute force", threads[t], result.psnr, result.milliseconds);
+                }
+            }
+        }
+    }
+
+    // a configuration is on the Pareto front if every faster one has a lower quality
+    std::vector<size_t> order(results.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return results[a].milliseconds < results[b].milliseconds || (results[a].milliseconds == results[b].milliseconds && results[a].psnr > results[b].psnr);
+    });
+    double best_psnr = -DBL_MAX;
+    for (size_t i = 0; i < order.size(); i++) {
+        autotune_result_s& result = results[order[i]];
+        result.pareto = result.psnr > best_psnr;
+        best_psnr = std::max(best_psnr, result.psnr);
+    }
+}
+
+int welsh_autotune_select(const std::vector<autotune_result_s>& results, double budget_ms) {
+    int best = -1, fastest = -1;
+    for (size_t i = 0; i < results.size(); i++) {
+        const autotune_result_s& result = results[i];
+        if (fastest < 0 || result.milliseconds < results[fastest].milliseconds) fastest = i;
+        if (result.milliseconds > budget_ms) continue;
+        if (best < 0 || result.psnr > results[best].psnr || (result.psnr == results[best].psnr && result.milliseconds < results[best].milliseconds)) 
+            best = i;
+    }
+    return best >= 0 ? best : fastest;
+}
+
+uint64_t welsh_build_model(Mat& source_img, const char * model_path, params prm) {
+    struct params_s resolved_prm = resolve_params(prm);
+    prm = &resolved_prm;
+    exit_if(source_img.empty() || source_img.type() != CV_8UC3, "Error: the source must be a non empty 8-bit BGR image");
+    uint64_t source_hash = hash_image(source_img);
+    uint64_t params_hash = hash_model_params(prm);
+    uint64_t key = fnv1a_hash(source_hash, &params_hash, sizeof(params_hash));
+
+    // a directory receives the model named after its key, so models can be cached by source and parameters
+    std::string path = model_path;
+    struct stat info;
+    if (stat(model_path, &info) == 0 && S_ISDIR(info.st_mode)) 
+        path += format("/%016llx" MODEL_FILE_EXTENSION, (unsigned long long)key);
+
+    Mat src;
+    convert_color(source_img, src, COLOR_BGR2Lab);
+    source_model_s model;
+    build_source_model(model, src, prm);
+    bool saved = save_source_model(model, path.c_str(), source_hash);
+    free_source_model(model);
+    exit_if(!saved, "Error: cannot write the model file");
+    if (prm->verbose) printf("Model %016llx written to %s\n", (unsigned long long)key, path.c_str());
+    return key;
+}
 
 void welsh_colorisation(Mat& source_img, Mat& target_img, const char * dst_img, params prm) {
-    if (prm == NULL) prm = create_default_params();
+    struct params_s resolved_prm = resolve_params(prm);
+    prm = &resolved_prm;
     run(source_img, target_img, prm);
     imwrite(dst_img, target_img);
 }
 
 void welsh_colorisation_swatches(Mat& source_img, Mat& target_img, const char * dst_img, params prm, const vec_swatch& src_rect, const vec_swatch& target_rect) {
     exit_if(src_rect.size() != target_rect.size(), "Error: the number of swatches in the source and target does not match.");
-    if (prm == NULL) prm = create_default_params(); 
-    std::cout << src_rect.size() << std::endl;
+    struct params_s resolved_prm = resolve_params(prm);
+    prm = &resolved_prm;
     run_swatch(source_img, target_img, src_rect, target_rect, prm);
     imwrite(dst_img, target_img);
-}
\ No newline at end of file
+}
+void welsh_colorisation_sequence(Mat& source_img, const char * input, const char * output, params prm, sequence_report_s * report) {
+    if (source_img.empty() || source_img.type() != CV_8UC3)
+        throw ColorisationError("the source must be a non empty 8-bit BGR image");
+    struct params_s resolved_prm = resolve_params(prm);
+    prm = &resolved_prm;
+    // the changed tiles are matched pixel by pixel with the stats, the other matchings would give another result
+    if (prm->pyramid_levels > 1 || prm->superpixel_size > 0 || prm->descriptor == TEXTURE_DESCRIPTOR)
+        throw ColorisationError("the sequence colorisation only matches pixels by stats at full resolution (no pyramid, superpixels or texture descriptor)");
+    run_sequence(source_img, input, output, prm, report);
+}
+
+void welsh_colorisation_batch(Mat& source_img, const std::vector<String>& target_paths, const char * output_dir, params prm, batch_report_s * report) {
+    if (source_img.empty() || source_img.type() != CV_8UC3)
+        throw ColorisationError("the source must be a non empty 8-bit BGR image");
+    struct params_s resolved_prm = resolve_params(prm);
+    prm = &resolved_prm;
+    // a single source model is bound to every image, there is no source pyramid
+    if (prm->pyramid_levels > 1)
+        throw ColorisationError("the batch colorisation has no coarse-to-fine matching (pyramid_levels must be 1)");
+    run_batch(source_img, target_paths, output_dir, prm, report);
+}
+
+void welsh_colorisation_streaming(Mat& source_img, const char * target_path, const char * dst_path, params prm) {
+    if (source_img.empty() || source_img.type() != CV_8UC3)
+        throw ColorisationError("the source must be a non empty 8-bit BGR image");
+    struct params_s resolved_prm = resolve_params(prm);
+    prm = &resolved_prm;
+    // the strips are matched pixel by pixel with the stats, the other matchings would give another result
+    if (prm->pyramid_levels > 1 || prm->superpixel_size > 0 || prm->descriptor == TEXTURE_DESCRIPTOR)
+        throw ColorisationError("the strip colorisation only matches pixels by stats at full resolution (no pyramid, superpixels or texture descriptor)");
+    run_streaming(source_img, target_path, dst_path, prm);
+}
+
+/**
+ * @brief Write the times and counters of the instrumentation of a thread as JSON members
+ */
+void write_instrumentation_slot(FILE * out, const instrumentation_slot_s& slot, const char * indent) {
+    fprintf(out, "%s\"stages\": {\n", indent);
+    for (int i = 0; i < NB_STAGES; i++) {
+        fprintf(out, "%s  \"%s\": {\"calls\": %ld, \"seconds\": %.6f}%s\n", indent, stage_names[i], slot.calls[i], slot.seconds[i], i + 1 < NB_STAGES ? "," : "");
+    }
+    fprintf(out, "%s},\n%s\"counters\": {\n", indent, indent);
+    for (int i = 0; i < NB_COUNTERS; i++) {
+        fprintf(out, "%s  \"%s\": %ld%s\n", indent, counter_names[i], slot.counters[i], i + 1 < NB_COUNTERS ? "," : "");
+    }
+    fprintf(out, "%s}", indent);
+}
+
+void instrumentation_write_json(FILE * out) {
+    std::lock_guard<std::mutex> lock(instrumentation_mutex);
+    instrumentation_slot_s total = instrumentation_slot_s();
+    for (size_t t = 0; t < instrumentation_slots.size(); t++) {
+        for (int i = 0; i < NB_STAGES; i++) {
+            total.seconds[i] += instrumentation_slots[t]->seconds[i];
+            total.calls[i] += instrumentation_slots[t]->calls[i];
+        }
+        for (int i = 0; i < NB_COUNTERS; i++) total.counters[i] += instrumentation_slots[t]->counters[i];
+    }
+    fprintf(out, "{\n");
+    write_instrumentation_slot(out, total, "  ");
+    fprintf(out, ",\n  \"threads\": [\n");
+    for (size_t t = 0; t < instrumentation_slots.size(); t++) {
+        fprintf(out, "    {\n");
+        write_instrumentation_slot(out, *instrumentation_slots[t], "      ");
+        fprintf(out, "\n    }%s\n", t + 1 < instrumentation_slots.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+void instrumentation_reset() {
+    std::lock_guard<std::mutex> lock(instrumentation_mutex);
+    for (size_t t = 0; t < instrumentation_slots.size(); t++) *instrumentation_slots[t] = instrumentation_slot_s();
+}
+
+/**
+ * @brief Check that the parameters can be used to sample an image of the given size
+ * 
+ * @param prm 
+ * @param size The size of the source image, empty if the source is not sampled (model file)
+ * @throw ColorisationError 
+ */
+void check_params(const struct params_s& prm, const Size& size) {
+    if (prm.neighborhood_window_size == 0 || prm.neighborhood_window_size % 2 == 0) 
+        throw ColorisationError("the neighborhood window size must be an odd integer");
+    if (prm.samples == 0) 
+        throw ColorisationError("the number of samples must be positive");
+    if (size.area() > 0 && prm.sampling == JITTERED && (int)sqrt(prm.samples) > std::min(size.width, size.height))
+        throw ColorisationError("too many samples for the size of the reference image");
+    if (prm.search == LOOKUP_TABLE && prm.lut_resolution <= 0)
+        throw ColorisationError("the lookup table resolution must be positive");
+    if (prm.pyramid_tolerance < 0)
+        throw ColorisationError("the pyramid tolerance must be positive");
+}
+
+Colorizer::Colorizer(const Mat& reference, const struct params_s& prm) : Colorizer(std::vector<Mat>(1, reference), prm) {
+}
+
+Colorizer::Colorizer(const std::vector<Mat>& references, const struct params_s& prm) : prm(prm), model(NULL), levels(1), buffers(NULL) {
+    if (references.empty()) 
+        throw ColorisationError("at least one reference is needed");
+    std::vector<Mat> references_lab(references.size());
+    for (size_t i = 0; i < references.size(); i++) {
+        if (references[i].empty() || references[i].type() != CV_8UC3) 
+            throw ColorisationError("the reference must be a non empty 8-bit BGR image");
+        check_params(prm, references[i].size());
+        convert_color(references[i], references_lab[i], COLOR_BGR2Lab);
+    }
+    if (references.size() == 1) levels = get_pyramid_levels(references[0].size(), &this->prm);
+    model = new source_model_s[levels];
+    buffers = new stat_buffers_s;
+    if (references.size() > 1) build_merged_source_model(*model, references_lab, &this->prm);
+    else if (levels > 1) build_source_pyramid(model, levels, references_lab[0], &this->prm);
+    else build_source_model(*model, references_lab[0], &this->prm);
+}
+
+Colorizer::Colorizer(const char * model_path, const struct params_s& prm) : prm(prm), model(NULL), levels(1), buffers(NULL) {
+    check_params(prm, Size());
+    model = new source_model_s[1];
+    if (!load_source_model(*model, model_path)) {
+        delete[] model;
+        throw ColorisationError(std::string("cannot load the model file ") + model_path);
+    }
+    if (model->header->params_hash != hash_model_params(&this->prm)) {
+        free_source_model(*model);
+        delete[] model;
+        throw ColorisationError(std::string("the model file ") + model_path + " was built with other sampling parameters");
+    }
+    buffers = new stat_buffers_s;
+}
+
+Colorizer::~Colorizer() {
+    for (int level = 0; level < levels; level++) free_source_model(model[level]);
+    delete[] model;
+    delete buffers;
+}
+
+void Colorizer::colorise(const Mat& target, Mat& dst) {
+    if (target.type() == CV_8UC1) {
+        // the luminance is written straight to the result, whose colors are converted in place at the end
+        colorise_lab(target, dst);
+        convert_color(dst, dst, COLOR_Lab2BGR);
+        return;
+    }
+    colorise_lab(target, target_lab);
+    convert_color(target_lab, dst, COLOR_Lab2BGR);
+}
+
+void Colorizer::colorise_lab(const Mat& target, Mat& dst) {
+    if (target.empty() || (target.type() != CV_8UC3 && target.type() != CV_8UC1))
+        throw ColorisationError("the target must be a non empty 8-bit BGR or grayscale image");
+    int target_levels = std::min(levels, get_pyramid_levels(target.size(), &prm));
+    if (target.channels() == 1) {
+        Mat gray = target; // keeps the target alive if it is dst
+        gray_to_luminance(gray, &dst, *buffers, &prm);
+        if (target_levels > 1) {
+            transfer_color_pyramid(model, target_levels, dst, &prm, target_stats, *buffers);
+        } else {
+            compute_luminance_stats(&prm, target_stats, *buffers);
+            bind_and_transfer_stats(*model, dst, &prm, target_stats, *buffers);
+        }
+        return;
+    }
+    convert_color(target, dst, COLOR_BGR2Lab);
+    if (target_levels > 1) transfer_color_pyramid(model, target_levels, dst, &prm, target_stats, *buffers);
+    else bind_and_transfer(*model, dst, &prm, target_stats, *buffers);
+}
+
+void Colorizer::draw_samples(const Mat& reference, Mat& dst, int index) const {
+    reference.copyTo(dst);
+    // the finest level holds the samples of the reference at full resolution
+    const source_model_s& samples = model[0];
+    for (int i = 0; i < samples.nb_samples; i++) {
+        if (samples.origin[i] != index) continue;
+        Point pos(samples.pos[i][0], samples.pos[i][1]);
+        if (pos.x < dst.cols && pos.y < dst.rows) dst.at<Vec3b>(pos) = Vec3b(0, 0, 255);
+    }
+}
+
+void Colorizer::colorise_ab(const Mat& target, Mat& dst) {
+    if (target.empty() || (target.type() != CV_8UC3 && target.type() != CV_8UC1))
+        throw ColorisationError("the target must be a non empty 8-bit BGR or grayscale image");
+    const uchar * previous_data = dst.data;
+    dst.create(target.size(), CV_8UC2);
+    count_mat_allocation(dst, previous_data);
+    int target_levels = std::min(levels, get_pyramid_levels(target.size(), &prm));
+    if (target.channels() == 1 && target_levels == 1) {
+        // the colors are transferred to dst directly, the target is only converted to its luminance plane
+        gray_to_luminance(target, NULL, *buffers, &prm);
+        compute_luminance_stats(&prm, target_stats, *buffers);
+        bind_and_transfer_stats(*model, dst, &prm, target_stats, *buffers);
+        return;
+    }
+    // the coarse-to-fine matching and the BGR targets need the LAB image of the target
+    colorise_lab(target, target_lab);
+    const int from_to[] = { 1, 0, 2, 1 };
+    mixChannels(&target_lab, 1, &dst, 1, from_to, 2);
+}
+
+/**
+ * @brief Clamp a swatch to an image, and check it can hold the samples of the session
+ * 
+ * @param rect 
+ * @param size The size of the image
+ * @param session 
+ * @return Rect 
+ * @throw ColorisationError 
+ */
+Rect clamp_session_swatch(const Rect2d& rect, const Size& size, const swatch_session_s& session) {
+    Rect clamped = Rect(rect) & Rect(0, 0, size.width, size.height);
+    int n = sqrt(session.samples_per_swatch);
+    if (clamped.width < n || clamped.height < n) 
+        throw ColorisationError(format("a swatch must be at least %dx%d pixels", n, n));
+    return clamped;
+}
+
+/**
+ * @brief Search the best sample of the diffused pixels among the samples of the given swatches.
+ * A pixel keeps its match unless one of these samples is better, so only the samples that were not 
+ * compared with it yet need to be searched.
+ * 
+ * @param session 
+ * @param swatch_ids The swatches whose samples are searched
+ * @param unmatched_only If true, only the pixels without match are searched
+ * @param report Incremented by the pixels searched and candidates evaluated
+ */
+void search_session_pixels(swatch_session_s& session, const std::vector<int>& swatch_ids, bool unmatched_only, swatch_edit_report_s& report) {
+    if (swatch_ids.empty()) return;
+    stage_timer_s timer(STAGE_DIFFUSE_COLOR);
+    params prm = &session.prm;
+    window_sq_diff_kernel kernel = get_window_sq_diff_kernel(prm);
+    long searched_pixels = 0, pruned = 0;
+    #pragma omp parallel num_threads(get_thread_count(prm)) reduction(+:searched_pixels, pruned)
+    {
+        std::vector<double> lower_bounds(session.samples.size());
+        #pragma omp for schedule(dynamic)
+        for (int y = 0; y < session.luminance.rows; y++) {
+            const int * owner_row = session.owner.ptr<int>(y);
+            int * match_row = session.match.ptr<int>(y);
+            int * error_row = session.error.ptr<int>(y);
+            for (int x = 0; x < session.luminance.cols; x++) {
+                if (owner_row[x] >= 0 || (unmatched_only && match_row[x] >= 0)) continue;
+                for (size_t i = 0; i < swatch_ids.size(); i++) {
+                    int begin = swatch_ids[i] * session.samples_per_swatch;
+                    search_minimum_error_distance(session.luminance, session.sum, session.sqsum, x, y, session.samples, session.sample_stats, 
+                                                  begin, begin + session.samples_per_swatch, lower_bounds.data(), kernel, prm, 
+                                                  error_row[x], match_row[x], pruned);
+                }
+                searched_pixels++;
+            }
+        }
+    }
+    long candidates = searched_pixels * (long)swatch_ids.size() * session.samples_per_swatch;
+    instrument_count(COUNTER_PIXELS_MATCHED, searched_pixels);
+    instrument_count(COUNTER_CANDIDATES_EVALUATED, candidates - pruned);
+    instrument_count(COUNTER_CANDIDATES_PRUNED, pruned);
+    report.pixels_searched += searched_pixels;
+    report.candidates_evaluated += candidates - pruned;
+}
+
+SwatchSession::SwatchSession(const Mat& source, const Mat& target, const struct params_s& prm) : state(NULL) {
+    if (source.empty() || source.type() != CV_8UC3) 
+        throw ColorisationError("the source must be a non empty 8-bit BGR image");
+    if (target.empty() || (target.type() != CV_8UC3 && target.type() != CV_8UC1))
+        throw ColorisationError("the target must be a non empty 8-bit BGR or grayscale image");
+    check_params(prm, Size());
+    state = new swatch_session_s;
+    state->prm = prm;
+    int n = sqrt(SWATCH_SAMPLES);
+    state->samples_per_swatch = n * n;
+    convert_color(source, state->source_lab, COLOR_BGR2Lab);
+    if (target.channels() == 1) {
+        Mat target_bgr;
+        convert_color(target, target_bgr, COLOR_GRAY2BGR);
+        convert_color(target_bgr, state->target_lab, COLOR_BGR2Lab);
+    } else {
+        convert_color(target, state->target_lab, COLOR_BGR2Lab);
+    }
+    extractChannel(state->target_lab, state->luminance, 0);
+    integral(state->luminance, state->sum, state->sqsum, CV_64F, CV_64F);
+    state->owner = Mat(target.size(), CV_32SC1, Scalar(-1));
+    state->match = Mat(target.size(), CV_32SC1, Scalar(-1));
+    state->error = Mat(target.size(), CV_32SC1, Scalar(INT_MAX));
+    report = swatch_edit_report_s();
+}
+
+SwatchSession::~SwatchSession() {
+    delete state;
+}
+
+int SwatchSession::add_swatch(const Rect2d& src_rect, const Rect2d& target_rect) {
+    auto start = std::chrono::steady_clock::now();
+    report = swatch_edit_report_s();
+    session_swatch_s swatch;
+    swatch.alive = true;
+    swatch.src_rect = clamp_session_swatch(src_rect, state->source_lab.size(), *state);
+    swatch.target_rect = clamp_session_swatch(target_rect, state->target_lab.size(), *state);
+    int id = state->swatches.size();
+
+    // colorise the target swatch with the source swatch, with fewer samples than the whole images
+    struct params_s swatch_prm = state->prm;
+    swatch_prm.samples = state->samples_per_swatch;
+    Mat src_swatch = state->source_lab(swatch.src_rect);
+    swatch.colors = state->target_lab(swatch.target_rect).clone();
+    sample_and_transfer(src_swatch, swatch.colors, &swatch_prm);
+
+    // each swatch draws its samples from its own seed, so they do not depend on the previous edits, and 
+    // are the ones diffuse_color draws for the same swatch
+    RNG rng(get_swatch_seed(&swatch_prm, swatch.target_rect));
+    sample_swatch(state->luminance, state->sum, state->sqsum, swatch.target_rect, &swatch_prm, rng, state->samples, state->sample_stats);
+    state->swatches.push_back(swatch);
+
+    // the swatch colors its pixels, and the other pixels are only compared with its samples
+    state->owner(swatch.target_rect).setTo(Scalar(id));
+    state->match(swatch.target_rect).setTo(Scalar(-1));
+    state->error(swatch.target_rect).setTo(Scalar(INT_MAX));
+    search_session_pixels(*state, std::vector<int>(1, id), false, report);
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    report.milliseconds = elapsed.count();
+    return id;
+}
+
+void SwatchSession::remove_swatch(int id) {
+    if (id < 0 || id >= (int)state->swatches.size() || !state->swatches[id].alive)
+        throw ColorisationError(format("no swatch %d in the session", id));
+    auto start = std::chrono::steady_clock::now();
+    report = swatch_edit_report_s();
+    session_swatch_s& swatch = state->swatches[id];
+    swatch.alive = false;
+    swatch.colors.release();
+
+    // the pixels it colored go to the last swatch covering them, or are diffused
+    std::vector<int> alive;
+    for (int i = id - 1; i >= 0; i--) {
+        if (state->swatches[i].alive) alive.push_back(i);
+    }
+    const Rect& rect = swatch.target_rect;
+    for (int y = rect.y; y < rect.y + rect.height; y++) {
+        int * owner_row = state->owner.ptr<int>(y);
+        for (int x = rect.x; x < rect.x + rect.width; x++) {
+            if (owner_row[x] != id) continue;
+            owner_row[x] = -1;
+            for (size_t i = 0; i < alive.size() && owner_row[x] < 0; i++) {
+                if (state->swatches[alive[i]].target_rect.contains(Point(x, y))) owner_row[x] = alive[i];
+            }
+        }
+    }
+
+    // the diffused pixels that matched its samples are searched again among the remaining samples
+    int begin = id * state->samples_per_swatch, end = begin + state->samples_per_swatch;
+    for (int y = 0; y < state->match.rows; y++) {
+        int * match_row = state->match.ptr<int>(y);
+        int * error_row = state->error.ptr<int>(y);
+        for (int x = 0; x < state->match.cols; x++) {
+            if (match_row[x] >= begin && match_row[x] < end) {
+                match_row[x] = -1;
+                error_row[x] = INT_MAX;
+            }
+        }
+    }
+    std::vector<int> remaining;
+    for (size_t i = 0; i < state->swatches.size(); i++) {
+        if (state->swatches[i].alive) remaining.push_back(i);
+    }
+    search_session_pixels(*state, remaining, true, report);
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    report.milliseconds = elapsed.count();
+}
+
+int SwatchSession::move_swatch(int id, const Rect2d& src_rect, const Rect2d& target_rect) {
+    clamp_session_swatch(src_rect, state->source_lab.size(), *state);
+    clamp_session_swatch(target_rect, state->target_lab.size(), *state);
+    remove_swatch(id);
+    swatch_edit_report_s removal = report;
+    int new_id = add_swatch(src_rect, target_rect);
+    report.pixels_searched += removal.pixels_searched;
+    report.candidates_evaluated += removal.candidates_evaluated;
+    report.milliseconds += removal.milliseconds;
+    return new_id;
+}
+
+void SwatchSession::render(Mat& dst) {
+    Mat& target = state->target_lab;
+    // the pixels of the swatches first, the diffused pixels copy the colors of their sample
+    for (int y = 0; y < target.rows; y++) {
+        Vec3b * target_row = target.ptr<Vec3b>(y);
+        const int * owner_row = state->owner.ptr<int>(y);
+        for (int x = 0; x < target.cols; x++) {
+            target_row[x][1] = target_row[x][2] = 128;
+            if (owner_row[x] < 0) continue;
+            const session_swatch_s& swatch = state->swatches[owner_row[x]];
+            const Vec3b& color = swatch.colors.at<Vec3b>(y - swatch.target_rect.y, x - swatch.target_rect.x);
+            target_row[x][1] = color[1];
+            target_row[x][2] = color[2];
+        }
+    }
+    for (int y = 0; y < target.rows; y++) {
+        Vec3b * target_row = target.ptr<Vec3b>(y);
+        const int * match_row = state->match.ptr<int>(y);
+        for (int x = 0; x < target.cols; x++) {
+            if (match_row[x] < 0) continue;
+            const Vec2i& sample = state->samples[match_row[x]];
+            const Vec3b& color = target.at<Vec3b>(sample[1], sample[0]);
+            target_row[x][1] = color[1];
+            target_row[x][2] = color[2];
+        }
+    }
+    convert_color(target, dst, COLOR_Lab2BGR);
+}
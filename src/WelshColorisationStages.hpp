@@ -0,0 +1,256 @@
+/**
+ * @file WelshColorisationStages.hpp
+ * @brief Internal data structures and stages of the colorisation pipeline.
+ * Not part of the public API: exposed for the stage benchmark.
+ */
+
+#ifndef WELSH_COLORISATION_STAGES_HPP
+#define WELSH_COLORISATION_STAGES_HPP
+
+#include <stdint.h>
+
+#include "WelshColorisation.hpp"
+
+typedef std::vector<Rect2d> vec_swatch;
+
+/**
+ * @brief Implicit 2-d tree over the (mean, stddev) stats of the samples.
+ * The node of the range [begin, end) of order is its middle element, split along axis[middle]. 
+ * Ranges of at most KD_TREE_LEAF_SIZE elements are leaves.
+ */
+struct kd_tree_s {
+    std::vector<int> order;     // sample indices, arranged as the tree
+    std::vector<uchar> axis;    // split axis (0 = mean, 1 = stddev) of each node
+};
+
+/**
+ * @brief Neighborhood stats of the samples, stored as separate aligned arrays for the SIMD kernels
+ */
+struct sample_stats_s {
+    float * mean;       // mean luminance of the neighborhood of each sample
+    float * stddev;     // luminance standard deviation of the neighborhood of each sample
+    int size;           // number of samples
+};
+
+/**
+ * @brief Exact stats of a luminance window of n pixels, used to bound the SSD between two windows
+ */
+struct window_stat_s {
+    double sum;         // sum of the luminance (an exact integer)
+    double dev;         // sqrt(n * sum of the squares - sum²), i.e. n times the standard deviation
+};
+
+/**
+ * @brief Node of a random projection tree: the samples of an inner node are split at the median of their 
+ * projection on a random direction
+ */
+struct rp_node_s {
+    int left;                   // left child (projection below the threshold), -1 for a leaf
+    int right;                  // right child
+    float threshold;            // projection of the median sample
+    int begin;                  // range of the samples of the node in the order of the forest
+    int end;
+};
+
+/**
+ * @brief Forest of random projection trees over the texture descriptors of the samples (approximate 
+ * nearest neighbour search): a query is compared with the samples of the leaf it falls in, in each tree
+ */
+struct rp_forest_s {
+    std::vector<rp_node_s> nodes;       // nodes of all the trees
+    std::vector<float> directions;      // projection direction of each node, DESCRIPTOR_SIZE floats per node
+    std::vector<int> roots;             // root node of each tree
+    std::vector<int> order;             // sample indices of each tree, one after another
+    std::vector<std::pair<float, int> > projections; // projection of the samples of a node while it is built
+};
+
+/**
+ * @brief Best matching sample of each cell of the quantized (mean, stddev) plane.
+ * The match of the cell (i, j) is matches[j * mean_bins + i], computed for the stats at the center of the cell.
+ */
+struct match_table_s {
+    double resolution;          // size of a cell in luminance units
+    int mean_bins;              // number of cells along the mean axis
+    int dev_bins;               // number of cells along the stddev axis
+    std::vector<int> matches;   // index of the best sample of each cell
+};
+
+/**
+ * @brief Intermediate images of compute_neighborhood_stats, kept to be reused between images of the same size
+ */
+struct stat_buffers_s {
+    Mat luminance;      // luminance plane (CV_8UC1)
+    Mat sum;            // integral image of the luminance (CV_64F)
+    Mat sqsum;          // integral image of the squared luminance (CV_64F)
+};
+
+/**
+ * @brief Luminance distribution of a source image of a model (remap parameters)
+ */
+struct model_origin_s {
+    double mean;                    // mean luminance of the source
+    double stddev;                  // luminance standard deviation of the source
+};
+
+/**
+ * @brief Header of the data of a source model, as stored in a model file (native byte order).
+ * The arrays of the model follow it at the given offsets, aligned on 8 bytes, so a mapped file is used in place.
+ */
+struct model_file_header_s {
+    char magic[8];                  // MODEL_FILE_MAGIC
+    uint32_t version;               // MODEL_FILE_VERSION
+    int32_t window_size;            // neighborhood window size of the patches
+    uint64_t source_hash;           // hash of the source pixels (0 if the model was not written to a file)
+    uint64_t params_hash;           // hash of the sampling parameters, see hash_model_params
+    int32_t nb_samples;
+    int32_t nb_origins;             // number of source images the samples were taken from
+    uint64_t origins_offset;        // model_origin_s per source image
+    uint64_t pos_offset;            // Vec2i per sample
+    uint64_t patch_size_offset;     // Vec2i per sample
+    uint64_t origin_offset;         // int32 per sample, index of its source image
+    uint64_t stats_offset;          // (mean, stddev) float pair per sample, of the source luminance (not remapped)
+    uint64_t chroma_offset;         // Vec2b per sample
+    uint64_t patches_offset;        // window_size² bytes per sample
+    uint64_t size;                  // size of the header and arrays
+};
+
+/**
+ * @brief Colorisation model of a source image: its samples, independently of any target.
+ * The luminance of the neighborhood of each sample is kept, so the model can be remapped to the 
+ * luminance distribution of any target without touching the source image again.
+ * The arrays point into the model data: built in memory by build_source_model, or mapped from a 
+ * model file by load_source_model.
+ */
+struct source_model_s {
+    int window_size;                // neighborhood window size of the patches
+    int nb_samples = 0;
+    int nb_origins = 0;             // number of source images the samples were taken from
+    const model_origin_s * origins = NULL; // luminance distribution of each source image
+    const int32_t * origin = NULL;  // source image of each sample
+    const Vec2i * pos = NULL;       // position of each sample in the source
+    const Vec2b * chroma = NULL;    // A and B channels of each sample
+    const Vec2i * patch_size = NULL;  // size of the neighborhood of each sample (clamped to the source borders)
+    const uchar * patches = NULL;   // luminance of the neighborhood of each sample, window_size² bytes per sample
+    const float * src_stats = NULL; // (mean, stddev) of the neighborhood of each sample, before any remap
+    const model_file_header_s * header = NULL;
+    std::vector<uint64_t> storage;  // model data built in memory (8 bytes aligned)
+    void * mapping = NULL;          // model file mapped in memory
+    size_t mapping_size = 0;
+
+    // bound to a target luminance distribution, see bind_source_model
+    bool bound = false;
+    double target_mean;             // mean luminance the samples are remapped to
+    double target_stddev;           // luminance standard deviation the samples are remapped to
+    search_method search;           // search structure built over the stats
+    std::vector<uchar> luts;        // luminance remap table of each source image, 256 entries each
+    sample_stats_s stats = {NULL, NULL, 0};  // remapped neighborhood stats of the samples
+    kd_tree_s tree;
+    match_table_s table;
+    descriptor_type descriptor;     // descriptor the texture descriptors are computed for
+    int forest_trees;               // number of trees of the forest
+    std::vector<float> descriptors; // remapped texture descriptors of the samples (TEXTURE_DESCRIPTOR only)
+    rp_forest_s forest;             // index of the texture descriptors
+};
+
+/**
+ * @brief Swatch of a SwatchSession
+ */
+struct session_swatch_s {
+    bool alive;                     // false once the swatch is removed (its samples are then never matched)
+    Rect src_rect;                  // swatch of the source, clamped to the source
+    Rect target_rect;               // swatch of the target, clamped to the target
+    Mat colors;                     // target swatch colorised by the source swatch (LAB)
+};
+
+/**
+ * @brief State of a SwatchSession.
+ * The samples of the swatch i are the entries [i * samples_per_swatch, (i + 1) * samples_per_swatch) of 
+ * samples and sample_stats. Swatch indices are never reused, so the match map stays valid across edits.
+ */
+struct swatch_session_s {
+    struct params_s prm;
+    int samples_per_swatch;
+    Mat source_lab;                 // source in LAB color space
+    Mat target_lab;                 // target in LAB color space, colorised by render
+    Mat luminance;                  // luminance plane of the target (CV_8UC1)
+    Mat sum;                        // integral image of the target luminance (CV_64F)
+    Mat sqsum;                      // integral image of the squared target luminance (CV_64F)
+    Mat owner;                      // swatch whose transfer colors each pixel, -1 if the pixel is diffused (CV_32S)
+    Mat match;                      // sample each diffused pixel takes its colors from, -1 if none (CV_32S)
+    Mat error;                      // error distance of the match of each diffused pixel (CV_32S)
+    std::vector<session_swatch_s> swatches;
+    std::vector<Vec2i> samples;     // position of the samples in the target
+    std::vector<window_stat_s> sample_stats; // stats of the full neighborhood window of each sample
+};
+
+/**
+ * @brief Compute the table remapping the source luminance distribution to fit the one of the target image
+ */
+void compute_remap_lut(double src_mean, double src_stddev, double target_mean, double target_stddev, uchar lut[256]);
+
+/**
+ * @brief Computes the neighborhood stats (mean, stddev) of the luminance of every pixel in the given LAB image
+ */
+void compute_neighborhood_stats(const Mat& img, params prm, Mat& stats, stat_buffers_s& buffers);
+
+/**
+ * @brief Mean luminance and standard deviation of the whole image, from the buffers of compute_neighborhood_stats
+ */
+Vec2d get_image_stat(const stat_buffers_s& buffers);
+
+/**
+ * @brief Sample the given LAB source image and keep the luminance of the neighborhood of each sample
+ */
+void build_source_model(source_model_s& model, const Mat& src, params prm);
+
+/**
+ * @brief Sample several LAB source images in parallel and merge their samples in a single model, tagged with their source
+ */
+void build_merged_source_model(source_model_s& model, const std::vector<Mat>& sources, params prm);
+
+/**
+ * @brief Remap the model luminance to the given target distribution, then compute the stats and search structures of the samples
+ */
+void bind_source_model(source_model_s& model, double target_mean, double target_stddev, params prm);
+
+/**
+ * @brief Free the memory held by a source model
+ */
+void free_source_model(source_model_s& model);
+
+/**
+ * @brief Write the data of a source model to a file, with the given hash of its source
+ */
+bool save_source_model(const source_model_s& model, const char * path, uint64_t source_hash);
+
+/**
+ * @brief Map a model file written by save_source_model in memory and use its data in place
+ */
+bool load_source_model(source_model_s& model, const char * path);
+
+/**
+ * @brief Transfer the chromaticity of the best matching sample to each pixel of the LAB target
+ */
+void transfer_color(const source_model_s& model, Mat& target, const Mat& target_stats, params prm);
+
+/**
+ * @brief Transfer the chromaticity of the sample with the closest texture descriptor to each pixel of the LAB target
+ */
+void transfer_color_descriptors(const source_model_s& model, Mat& target, const Mat& luminance, params prm);
+
+/**
+ * @brief Sample the source and colorise the target with it, both in LAB color space
+ */
+void sample_and_transfer(Mat& src, Mat& target, params prm);
+
+/**
+ * @brief Get the sub matrices corresponding to the swatches of the source and target images
+ */
+void get_swatch_matrices(Mat& src, Mat& target, const vec_swatch& src_swatches, const vec_swatch& target_swatches, std::vector<Mat>& src_swatch_mat, std::vector<Mat>& target_swatch_mat);
+
+/**
+ * @brief Spread the colors of the colorised swatches of the LAB target to its remaining pixels
+ */
+void diffuse_color(Mat& target, std::vector<Mat>& target_swatches, const vec_swatch& target_rect, params prm);
+
+#endif
@@ -1,6 +1,11 @@
 #include <iostream>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <cfloat>
 
 #include "opencv2/imgproc.hpp"
 #include "opencv2/imgcodecs.hpp"
@@ -10,24 +15,87 @@
 
 using namespace cv;
 
+static const char * instrumentation_path = NULL;
+
+enum long_option {
+    OPT_BUILD_MODEL = 256,
+    OPT_MODEL,
+    OPT_SEED,
+    OPT_PARAMS,
+    OPT_AUTOTUNE,
+    OPT_BUDGET,
+    OPT_TRUTH,
+    OPT_DESCRIPTOR,
+    OPT_FOREST_TREES
+};
+
+static const struct option long_options[] = {
+    { "build-model", required_argument, NULL, OPT_BUILD_MODEL },
+    { "model", required_argument, NULL, OPT_MODEL },
+    { "seed", required_argument, NULL, OPT_SEED },
+    { "params", required_argument, NULL, OPT_PARAMS },
+    { "autotune", required_argument, NULL, OPT_AUTOTUNE },
+    { "budget", required_argument, NULL, OPT_BUDGET },
+    { "truth", required_argument, NULL, OPT_TRUTH },
+    { "descriptor", required_argument, NULL, OPT_DESCRIPTOR },
+    { "forest-trees", required_argument, NULL, OPT_FOREST_TREES },
+    { NULL, 0, NULL, 0 }
+};
+
+/**
+ * @brief Write the instrumentation summary to the path given with -j ("-" for the standard output), at exit
+ */
+static void write_instrumentation() {
+    FILE * out = strcmp(instrumentation_path, "-") == 0 ? stdout : fopen(instrumentation_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open %s\n", instrumentation_path);
+        return;
+    }
+    instrumentation_write_json(out);
+    if (out != stdout) fclose(out);
+}
+
+/**
+ * @brief Load the colored source image, exit if it cannot be read
+ */
+static Mat read_source(const char * path) {
+    Mat src = imread(path);
+    if (src.empty()) {
+        fprintf(stderr, "Cannot read the source image %s\n", path);
+        exit(1);
+    }
+    return src;
+}
+
 int main(int argc, char ** argv) {
+    // the window is only created by the interactive modes, the others run without a display
     const char window_name[] = "Welsh Colorisation"; 
-    namedWindow(window_name, WINDOW_AUTOSIZE);
 
     int opt; 
     const char * color_path = NULL;
+    std::vector<const char *> color_paths;
     const char * gray_path = NULL;
     const char * dest_path = NULL;
+    const char * sequence_path = NULL;
+    const char * batch_path = NULL;
+    const char * streaming_path = NULL;
+    const char * build_model_path = NULL;
+    const char * model_path = NULL;
+    const char * autotune_path = NULL;
+    const char * truth_path = NULL;
+    double budget_ms = DBL_MAX;
     int swatches = 0;
+    bool interactive = false;
     params prm = create_default_params();
 
     // parse params
-    while((opt = getopt(argc, argv, ":c:g:d:w:svr:")) != -1)  
+    while((opt = getopt_long(argc, argv, ":c:g:d:w:n:m:q:svir:t:V:e:b:j:L:H:p:T:u:", long_options, NULL)) != -1)  
     {  
         switch(opt)  
         {    
             case 'c':  
-                color_path = optarg;
+                if (color_path == NULL) color_path = optarg;
+                color_paths.push_back(optarg);
                 break;  
             case 'g':  
                 gray_path = optarg;
@@ -38,12 +106,87 @@ int main(int argc, char ** argv) {
             case 'w':
                 prm->neighborhood_window_size = atoi(optarg);
                 break;
+            case 'n':
+                prm->samples = atoi(optarg);
+                break;
+            case 'm':
+                if (strcmp(optarg, "linear") == 0) prm->search = LINEAR_SEARCH;
+                else if (strcmp(optarg, "kdtree") == 0) prm->search = KD_TREE;
+                else if (strcmp(optarg, "lut") == 0) prm->search = LOOKUP_TABLE;
+                else printf("unknown search method: %s\n", optarg);
+                break;
+            case 'q':
+                prm->lut_resolution = atof(optarg);
+                break;
             case 's':
                 prm->show_samples = true;
                 break;
             case 'v':
                 prm->verbose = true;
                 break;
+            case 'i':
+                interactive = true;
+                break;
+            case 'V':
+                sequence_path = optarg;
+                break;
+            case 'b':
+                batch_path = optarg;
+                break;
+            case 'L':
+                streaming_path = optarg;
+                break;
+            case 'H':
+                prm->strip_rows = atoi(optarg);
+                break;
+            case 'p':
+                prm->pyramid_levels = atoi(optarg);
+                break;
+            case 'T':
+                prm->pyramid_tolerance = atof(optarg);
+                break;
+            case 'u':
+                prm->superpixel_size = atoi(optarg);
+                break;
+            case 'j':
+                instrumentation_path = optarg;
+                break;
+            case OPT_BUILD_MODEL:
+                build_model_path = optarg;
+                break;
+            case OPT_MODEL:
+                model_path = optarg;
+                break;
+            case OPT_SEED:
+                prm->seed = strtoul(optarg, NULL, 0);
+                break;
+            case OPT_PARAMS:
+                // the options that follow override the values of the file
+                if (!read_params_file(optarg, prm)) exit(1);
+                break;
+            case OPT_AUTOTUNE:
+                autotune_path = optarg;
+                break;
+            case OPT_BUDGET:
+                budget_ms = atof(optarg);
+                break;
+            case OPT_TRUTH:
+                truth_path = optarg;
+                break;
+            case OPT_DESCRIPTOR:
+                if (strcmp(optarg, "stats") == 0) prm->descriptor = STATS_DESCRIPTOR;
+                else if (strcmp(optarg, "texture") == 0) prm->descriptor = TEXTURE_DESCRIPTOR;
+                else printf("unknown descriptor: %s\n", optarg);
+                break;
+            case OPT_FOREST_TREES:
+                prm->forest_trees = atoi(optarg);
+                break;
+            case 'e':
+                prm->sequence_tolerance = atoi(optarg);
+                break;
+            case 't':
+                prm->threads = atoi(optarg);
+                break;
             case 'r':
                 swatches = atoi(optarg);
             case ':':  
@@ -55,19 +198,191 @@ int main(int argc, char ** argv) {
         }  
     }  
 
-    if (color_path == NULL || gray_path == NULL) {
-        fprintf(stderr, "-c and -g option are necessary\n");
+    if (build_model_path != NULL) {
+        if (color_path == NULL) {
+            fprintf(stderr, "-c option is necessary with --build-model\n");
+            exit(1);
+        }
+        Mat src = read_source(color_path);
+        uint64_t key = welsh_build_model(src, build_model_path, prm);
+        printf("model %016llx written\n", (unsigned long long)key);
+        return 0;
+    }
+
+    if (autotune_path != NULL) {
+        if (color_path == NULL || gray_path == NULL) {
+            fprintf(stderr, "-c and -g options are necessary with --autotune\n");
+            exit(1);
+        }
+        Mat src = read_source(color_path);
+        Mat target = imread(gray_path, IMREAD_GRAYSCALE);
+        Mat truth = truth_path != NULL ? imread(truth_path) : Mat();
+        std::vector<autotune_result_s> results;
+        try {
+            welsh_autotune(src, target, truth, prm, results);
+        } catch (const ColorisationError& e) {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+        if (results.empty()) {
+            fprintf(stderr, "no configuration can be used with these images\n");
+            exit(1);
+        }
+        printf("samples,window_size,sampling,threads,psnr,milliseconds,pareto\n");
+        for (size_t i = 0; i < results.size(); i++) {
+            const autotune_result_s& result = results[i];
+            printf("%u,%u,%s,%u,%.3f,%.3f,%d\n", result.prm.samples, result.prm.neighborhood_window_size, 
+                   result.prm.sampling == JITTERED ? "jittered" : "brute_force", result.prm.threads, result.psnr, result.milliseconds, result.pareto);
+        }
+        autotune_result_s best = results[welsh_autotune_select(results, budget_ms)];
+        if (!write_params_file(autotune_path, &best.prm)) exit(1);
+        printf("best configuration (%.2f dB in %.2f ms) written to %s\n", best.psnr, best.milliseconds, autotune_path);
+        return 0;
+    }
+
+    if (model_path != NULL) {
+        if (gray_path == NULL) {
+            fprintf(stderr, "-g option is necessary with --model\n");
+            exit(1);
+        }
+        if (instrumentation_path != NULL) atexit(write_instrumentation);
+        // the source image is not loaded, its samples are mapped from the model file
+        Mat target = imread(gray_path, IMREAD_GRAYSCALE);
+        Mat result;
+        try {
+            Colorizer colorizer(model_path, *prm);
+            colorizer.colorise(target, result);
+        } catch (const ColorisationError& e) {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+        imwrite(dest_path != NULL ? dest_path : "./a.png", result);
+        std::cout << "done!" << std::endl;
+        return 0;
+    }
+
+    if (color_path == NULL || (gray_path == NULL && sequence_path == NULL && batch_path == NULL && streaming_path == NULL)) {
+        fprintf(stderr, "-c and -g (or -V, -b or -L) option are necessary\n");
         exit(1);
     }
+    if (instrumentation_path != NULL) atexit(write_instrumentation);
+
+    if (batch_path != NULL) {
+        if (dest_path == NULL) {
+            fprintf(stderr, "-d option is necessary with -b\n");
+            exit(1);
+        }
+        // the targets are the files of a directory, or listed in a text file (one path per line)
+        std::vector<String> targets;
+        struct stat info;
+        if (stat(batch_path, &info) == 0 && S_ISDIR(info.st_mode)) {
+            glob(String(batch_path) + "/*", targets, false);
+        } else {
+            std::ifstream list(batch_path);
+            std::string line;
+            while (std::getline(list, line)) {
+                if (!line.empty()) targets.push_back(line);
+            }
+        }
+        Mat src = read_source(color_path);
+        batch_report_s report;
+        try {
+            welsh_colorisation_batch(src, targets, dest_path, prm, &report);
+        } catch (const ColorisationError& e) {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+        printf("%d images colorised in %.2f s (%.2f images/s), queue occupancy: decoded %.0f%%, colorised %.0f%%\n", 
+               report.images, report.seconds, report.images_per_second, 
+               100.0 * report.decoded_queue_occupancy, 100.0 * report.colorised_queue_occupancy);
+        return 0;
+    }
+
+    if (streaming_path != NULL) {
+        if (dest_path == NULL) {
+            fprintf(stderr, "-d option is necessary with -L\n");
+            exit(1);
+        }
+        Mat src = read_source(color_path);
+        try {
+            welsh_colorisation_streaming(src, streaming_path, dest_path, prm);
+        } catch (const ColorisationError& e) {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+        return 0;
+    }
+
+    if (sequence_path != NULL) {
+        if (dest_path == NULL) {
+            fprintf(stderr, "-d option is necessary with -V\n");
+            exit(1);
+        }
+        Mat src = read_source(color_path);
+        sequence_report_s report;
+        try {
+            welsh_colorisation_sequence(src, sequence_path, dest_path, prm, &report);
+        } catch (const ColorisationError& e) {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+        printf("%d frames colorised in %.2f s (%.2f frames/s), %.1f%% of the tiles reused\n", 
+               report.frames, report.seconds, report.frames_per_second, 100.0 * report.reused_tiles);
+        return 0;
+    }
 
     if (dest_path == NULL) {
         dest_path = "./a.png";
     }
 
     // ask user for swatches
-    Mat src = imread(color_path);
-    Mat target = imread(gray_path);
+    Mat src = read_source(color_path);
+    // the target is loaded as a single channel, unless the swatches are selected on it
+    Mat target = imread(gray_path, swatches > 0 ? IMREAD_COLOR : IMREAD_GRAYSCALE);
+
+    if (interactive) {
+        // the swatches are edited one at a time, each edit only colorises again the pixels it affects
+        Mat result;
+        namedWindow(window_name, WINDOW_AUTOSIZE);
+        try {
+            SwatchSession session(src, target, *prm);
+            std::vector<int> ids;
+            printf("a: add a swatch, m: move the last swatch, r: remove the last swatch, q: quit\n");
+            imshow(window_name, target);
+            for (int key = waitKey(0) & 0xFF; key != 'q'; key = waitKey(0) & 0xFF) {
+                if (key == 'r' && !ids.empty()) {
+                    session.remove_swatch(ids.back());
+                    ids.pop_back();
+                } else if (key == 'a' || (key == 'm' && !ids.empty())) {
+                    Rect2d r1 = selectROI(src, true, false);
+                    Rect2d r2 = selectROI(target, true, false);
+                    try {
+                        if (key == 'a') ids.push_back(session.add_swatch(r1, r2));
+                        else ids.back() = session.move_swatch(ids.back(), r1, r2);
+                    } catch (const ColorisationError& e) {
+                        fprintf(stderr, "%s\n", e.what());
+                        continue;
+                    }
+                } else {
+                    continue;
+                }
+                const swatch_edit_report_s& edit = session.last_edit();
+                printf("%ld pixels searched, %ld candidates evaluated in %.2f ms\n", edit.pixels_searched, edit.candidates_evaluated, edit.milliseconds);
+                session.render(result);
+                imshow(window_name, result);
+            }
+            session.render(result);
+        } catch (const ColorisationError& e) {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+        imwrite(dest_path, result);
+        std::cout << "done!" << std::endl;
+        return 0;
+    }
+
     std::vector<Rect2d> src_swatches, target_swatches;
+    if (swatches > 0) namedWindow(window_name, WINDOW_AUTOSIZE);
     for (int i = 0; i < swatches; i++) {
         Rect2d r1 = selectROI(src, true, false);
         Rect2d r2 = selectROI(target, true, false);
@@ -75,12 +390,28 @@ int main(int argc, char ** argv) {
         target_swatches.push_back(r2);
     }
 
-    if (swatches == 0)
-        welsh_colorisation(src, target, dest_path, prm);
-    else if (swatches > 0)
+    Mat result;
+    if (swatches == 0) {
+        try {
+            // several -c options give several references, whose samples are merged
+            std::vector<Mat> references(1, src);
+            for (size_t i = 1; i < color_paths.size(); i++) references.push_back(read_source(color_paths[i]));
+            Colorizer colorizer(references, *prm);
+            colorizer.colorise(target, result);
+            if (prm->show_samples) {
+                Mat samples;
+                colorizer.draw_samples(src, samples);
+                imwrite("samples.png", samples);
+            }
+        } catch (const ColorisationError& e) {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+        imwrite(dest_path, result);
+    } else if (swatches > 0) {
         welsh_colorisation_swatches(src, target, dest_path, prm, src_swatches, target_swatches);
+    }
 
-    Mat result = imread(dest_path);
     std::cout << "done!" << std::endl;
     // imshow(window_name, result);
     // waitKey(0);
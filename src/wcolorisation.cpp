@@ -0,0 +1,190 @@
+/**
+ * @file wcolorisation.cpp
+ * @brief C interface of libwcolorisation, over the Colorizer
+ *
+ */
+
+#include "wcolorisation.h"
+#include "WelshColorisation.hpp"
+
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+/**
+ * @brief A Colorizer, which keeps its buffers between calls
+ */
+struct wc_model {
+    Colorizer * colorizer;
+};
+
+static thread_local std::string last_error;
+
+/**
+ * @brief Record the message of an error of the calling thread
+ *
+ * @param status
+ * @param message
+ * @return wc_status status
+ */
+static wc_status fail(wc_status status, const char * message) {
+    last_error = message;
+    return status;
+}
+
+/**
+ * @brief Check the description of a caller buffer
+ *
+ * @param data
+ * @param width
+ * @param height
+ * @param stride
+ * @param pixel_size The number of bytes of a pixel
+ * @return true if the buffer is valid
+ */
+static bool valid_buffer(const uint8_t * data, int width, int height, size_t stride, size_t pixel_size) {
+    return data != NULL && width > 0 && height > 0 && stride >= (size_t)width * pixel_size;
+}
+
+/**
+ * @brief Convert the parameters of the C interface, the fields missing from an older caller keeping their default
+ *
+ * @param prm The parameters of the caller, or NULL
+ * @return struct params_s
+ */
+static struct params_s to_params(const wc_params * prm) {
+    wc_params values;
+    wc_params_default(&values);
+    if (prm != NULL) memcpy(&values, prm, std::min((size_t)prm->struct_size, sizeof(values)));
+
+    params defaults = create_default_params();
+    struct params_s converted = *defaults;
+    free(defaults);
+    converted.neighborhood_window_size = values.window_size;
+    converted.samples = values.samples;
+    converted.sampling = values.brute_force ? BRUTE_FORCE : JITTERED;
+    switch (values.search) {
+        case WC_LINEAR_SEARCH: converted.search = LINEAR_SEARCH; break;
+        case WC_LOOKUP_TABLE: converted.search = LOOKUP_TABLE; break;
+        default: converted.search = KD_TREE; break;
+    }
+    converted.lut_resolution = values.lut_resolution;
+    converted.mean_weight = values.mean_weight;
+    converted.threads = values.threads;
+    converted.seed = values.seed;
+    converted.pyramid_levels = values.pyramid_levels;
+    converted.pyramid_tolerance = values.pyramid_tolerance;
+    converted.superpixel_size = values.superpixel_size;
+    converted.descriptor = values.texture_descriptor ? TEXTURE_DESCRIPTOR : STATS_DESCRIPTOR;
+    converted.forest_trees = values.forest_trees;
+    return converted;
+}
+
+/**
+ * @brief Create a model around a new Colorizer, turning the exceptions into status codes
+ *
+ * @param create Builds the Colorizer
+ * @param model
+ * @return wc_status
+ */
+template<typename F>
+static wc_status create_model(F create, wc_model ** model) {
+    try {
+        wc_model * created = new wc_model();
+        try {
+            created->colorizer = create();
+        } catch (...) {
+            delete created;
+            throw;
+        }
+        *model = created;
+        return WC_OK;
+    } catch (const ColorisationError& e) {
+        return fail(WC_INVALID_ARGUMENT, e.what());
+    } catch (const std::exception& e) {
+        return fail(WC_INTERNAL_ERROR, e.what());
+    }
+}
+
+void wc_params_default(wc_params * prm) {
+    params defaults = create_default_params();
+    memset(prm, 0, sizeof(*prm));
+    prm->struct_size = sizeof(*prm);
+    prm->window_size = defaults->neighborhood_window_size;
+    prm->samples = defaults->samples;
+    prm->brute_force = defaults->sampling == BRUTE_FORCE;
+    prm->search = defaults->search == LINEAR_SEARCH ? WC_LINEAR_SEARCH : defaults->search == LOOKUP_TABLE ? WC_LOOKUP_TABLE : WC_KD_TREE;
+    prm->lut_resolution = defaults->lut_resolution;
+    prm->mean_weight = defaults->mean_weight;
+    prm->threads = defaults->threads;
+    prm->seed = defaults->seed;
+    prm->pyramid_levels = defaults->pyramid_levels;
+    prm->pyramid_tolerance = defaults->pyramid_tolerance;
+    prm->superpixel_size = defaults->superpixel_size;
+    prm->texture_descriptor = defaults->descriptor == TEXTURE_DESCRIPTOR;
+    prm->forest_trees = defaults->forest_trees;
+    free(defaults);
+}
+
+wc_status wc_model_create(const uint8_t * bgr, int width, int height, size_t stride, const wc_params * prm, wc_model ** model) {
+    last_error.clear();
+    if (model == NULL || !valid_buffer(bgr, width, height, stride, 3))
+        return fail(WC_INVALID_ARGUMENT, "invalid reference buffer");
+    struct params_s converted = to_params(prm);
+    // the reference is only read: its buffer is wrapped, not copied
+    Mat reference(height, width, CV_8UC3, (void *) bgr, stride);
+    return create_model([&]() { return new Colorizer(reference, converted); }, model);
+}
+
+wc_status wc_model_load(const char * path, const wc_params * prm, wc_model ** model) {
+    last_error.clear();
+    if (model == NULL || path == NULL)
+        return fail(WC_INVALID_ARGUMENT, "invalid model path");
+    struct params_s converted = to_params(prm);
+    wc_status status = create_model([&]() { return new Colorizer(path, converted); }, model);
+    return status == WC_INVALID_ARGUMENT ? WC_INVALID_MODEL : status;
+}
+
+void wc_model_destroy(wc_model * model) {
+    if (model == NULL) return;
+    delete model->colorizer;
+    delete model;
+}
+
+wc_status wc_colorise_bgr(wc_model * model, const uint8_t * gray, int width, int height, size_t gray_stride, uint8_t * bgr, size_t bgr_stride) {
+    last_error.clear();
+    if (model == NULL || !valid_buffer(gray, width, height, gray_stride, 1) || !valid_buffer(bgr, width, height, bgr_stride, 3))
+        return fail(WC_INVALID_ARGUMENT, "invalid image buffer");
+    try {
+        // the result has the size and type of the target, so the Colorizer writes in the caller buffer
+        Mat target(height, width, CV_8UC1, (void *) gray, gray_stride);
+        Mat dst(height, width, CV_8UC3, bgr, bgr_stride);
+        model->colorizer->colorise(target, dst);
+        return WC_OK;
+    } catch (const ColorisationError& e) {
+        return fail(WC_INVALID_ARGUMENT, e.what());
+    } catch (const std::exception& e) {
+        return fail(WC_INTERNAL_ERROR, e.what());
+    }
+}
+
+wc_status wc_colorise_ab(wc_model * model, const uint8_t * gray, int width, int height, size_t gray_stride, uint8_t * ab, size_t ab_stride) {
+    last_error.clear();
+    if (model == NULL || !valid_buffer(gray, width, height, gray_stride, 1) || !valid_buffer(ab, width, height, ab_stride, 2))
+        return fail(WC_INVALID_ARGUMENT, "invalid image buffer");
+    try {
+        // the result has the size and type of the target, so the colors are transferred to the caller buffer
+        Mat target(height, width, CV_8UC1, (void *) gray, gray_stride);
+        Mat dst(height, width, CV_8UC2, ab, ab_stride);
+        model->colorizer->colorise_ab(target, dst);
+        return WC_OK;
+    } catch (const ColorisationError& e) {
+        return fail(WC_INVALID_ARGUMENT, e.what());
+    } catch (const std::exception& e) {
+        return fail(WC_INTERNAL_ERROR, e.what());
+    }
+}
+
+const char * wc_last_error(void) {
+    return last_error.c_str();
+}
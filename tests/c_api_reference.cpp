@@ -0,0 +1,51 @@
+/**
+ * @file c_api_reference.cpp
+ * @brief C++ side of c_api_test: the results of the Colorizer the C interface must reproduce
+ *
+ */
+
+#include <string.h>
+
+#include "wcolorisation.h"
+#include "WelshColorisation.hpp"
+
+extern "C" int reference_colorise(const uint8_t * bgr, const uint8_t * gray, int width, int height, uint8_t * dst_bgr, uint8_t * dst_ab);
+
+/**
+ * @brief Colorise gray with a Colorizer of bgr and the default parameters, on tight buffers
+ *
+ * @param bgr The reference, width * 3 bytes per row
+ * @param gray The target, width bytes per row
+ * @param width
+ * @param height
+ * @param dst_bgr Receive the colorised target, width * 3 bytes per row
+ * @param dst_ab Receive the chromaticity of the colorised target, width * 2 bytes per row
+ * @return int 0 on success
+ */
+int reference_colorise(const uint8_t * bgr, const uint8_t * gray, int width, int height, uint8_t * dst_bgr, uint8_t * dst_ab) {
+    try {
+        params defaults = create_default_params();
+        struct params_s prm = *defaults;
+        free(defaults);
+        Mat reference(height, width, CV_8UC3, (void *) bgr);
+        Mat target(height, width, CV_8UC1, (void *) gray);
+        Colorizer colorizer(reference, prm);
+
+        Mat colorised;
+        colorizer.colorise(target, colorised);
+        for (int y = 0; y < height; y++) memcpy(dst_bgr + (size_t)y * width * 3, colorised.ptr(y), (size_t)width * 3);
+
+        Mat lab;
+        colorizer.colorise_lab(target, lab);
+        for (int y = 0; y < height; y++) {
+            const Vec3b * row = lab.ptr<Vec3b>(y);
+            for (int x = 0; x < width; x++) {
+                dst_ab[((size_t)y * width + x) * 2] = row[x][1];
+                dst_ab[((size_t)y * width + x) * 2 + 1] = row[x][2];
+            }
+        }
+        return 0;
+    } catch (const std::exception&) {
+        return 1;
+    }
+}
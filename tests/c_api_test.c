@@ -0,0 +1,122 @@
+/**
+ * @file c_api_test.c
+ * @brief Check that the C interface of libwcolorisation, compiled as C, gives the same results as the 
+ * Colorizer on strided buffers, and leaves their padding untouched
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wcolorisation.h"
+
+#define WIDTH 97
+#define HEIGHT 61
+#define PADDING 13
+#define PADDING_VALUE 0xa5
+
+int reference_colorise(const uint8_t * bgr, const uint8_t * gray, int width, int height, uint8_t * dst_bgr, uint8_t * dst_ab);
+
+static int failures = 0;
+
+/**
+ * @brief Report a failed check
+ */
+static void check(int condition, const char * message) {
+    if (condition) return;
+    fprintf(stderr, "FAILED: %s (%s)\n", message, wc_last_error());
+    failures++;
+}
+
+/**
+ * @brief Deterministic pseudo-random byte (linear congruential generator)
+ */
+static uint8_t next_byte(uint32_t * state) {
+    *state = *state * 1664525u + 1013904223u;
+    return (uint8_t)(*state >> 24);
+}
+
+/**
+ * @brief Fill a strided image with a smooth pattern and some noise, and its padding with PADDING_VALUE
+ */
+static void fill_image(uint8_t * data, size_t stride, int channels, uint32_t seed) {
+    uint32_t state = seed;
+    memset(data, PADDING_VALUE, stride * HEIGHT);
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            for (int c = 0; c < channels; c++) {
+                int value = (x * (c + 2) + y * (3 - c)) % 200 + next_byte(&state) % 56;
+                data[y * stride + x * channels + c] = (uint8_t)value;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Compare a strided image with a tight one, and check that the padding of the strided one is untouched
+ */
+static int same_image(const uint8_t * strided, size_t stride, const uint8_t * tight, int channels) {
+    size_t row_size = (size_t)WIDTH * channels;
+    for (int y = 0; y < HEIGHT; y++) {
+        if (memcmp(strided + y * stride, tight + y * row_size, row_size) != 0) return 0;
+        for (size_t i = row_size; i < stride; i++)
+            if (strided[y * stride + i] != PADDING_VALUE) return 0;
+    }
+    return 1;
+}
+
+int main(void) {
+    size_t bgr_stride = WIDTH * 3 + PADDING;
+    size_t gray_stride = WIDTH + PADDING;
+    size_t ab_stride = WIDTH * 2 + PADDING;
+    uint8_t * reference = malloc(bgr_stride * HEIGHT);
+    uint8_t * gray = malloc(gray_stride * HEIGHT);
+    uint8_t * tight_reference = malloc((size_t)WIDTH * 3 * HEIGHT);
+    uint8_t * tight_gray = malloc((size_t)WIDTH * HEIGHT);
+    uint8_t * bgr = malloc(bgr_stride * HEIGHT);
+    uint8_t * ab = malloc(ab_stride * HEIGHT);
+    uint8_t * expected_bgr = malloc((size_t)WIDTH * 3 * HEIGHT);
+    uint8_t * expected_ab = malloc((size_t)WIDTH * 2 * HEIGHT);
+    wc_params prm;
+    wc_model * model = NULL;
+
+    fill_image(reference, bgr_stride, 3, 1);
+    fill_image(gray, gray_stride, 1, 2);
+    for (int y = 0; y < HEIGHT; y++) {
+        memcpy(tight_reference + y * WIDTH * 3, reference + y * bgr_stride, WIDTH * 3);
+        memcpy(tight_gray + y * WIDTH, gray + y * gray_stride, WIDTH);
+    }
+    check(reference_colorise(tight_reference, tight_gray, WIDTH, HEIGHT, expected_bgr, expected_ab) == 0, "Colorizer");
+
+    wc_params_default(&prm);
+    check(wc_model_create(reference, WIDTH, HEIGHT, bgr_stride, &prm, &model) == WC_OK, "wc_model_create");
+    check(strcmp(wc_last_error(), "") == 0, "no error after a success");
+    if (model != NULL) {
+        memset(bgr, PADDING_VALUE, bgr_stride * HEIGHT);
+        check(wc_colorise_bgr(model, gray, WIDTH, HEIGHT, gray_stride, bgr, bgr_stride) == WC_OK, "wc_colorise_bgr");
+        check(same_image(bgr, bgr_stride, expected_bgr, 3), "wc_colorise_bgr matches Colorizer::colorise");
+
+        memset(ab, PADDING_VALUE, ab_stride * HEIGHT);
+        check(wc_colorise_ab(model, gray, WIDTH, HEIGHT, gray_stride, ab, ab_stride) == WC_OK, "wc_colorise_ab");
+        check(same_image(ab, ab_stride, expected_ab, 2), "wc_colorise_ab matches Colorizer::colorise_lab");
+
+        // a stride smaller than a row is rejected, and the error is cleared by the next successful call
+        check(wc_colorise_bgr(model, gray, WIDTH, HEIGHT, WIDTH - 1, bgr, bgr_stride) == WC_INVALID_ARGUMENT, "invalid stride");
+        check(strcmp(wc_last_error(), "") != 0, "error message after a failure");
+        check(wc_colorise_bgr(model, gray, WIDTH, HEIGHT, gray_stride, bgr, bgr_stride) == WC_OK, "wc_colorise_bgr after a failure");
+        check(strcmp(wc_last_error(), "") == 0, "error message cleared by a success");
+    }
+    wc_model_destroy(model);
+
+    free(reference);
+    free(gray);
+    free(tight_reference);
+    free(tight_gray);
+    free(bgr);
+    free(ab);
+    free(expected_bgr);
+    free(expected_ab);
+    if (failures == 0) printf("c_api_test: all checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+/**
+ * @file swatch_session_test.cpp
+ * @brief Check that a SwatchSession renders, after each add, move and remove, the image that 
+ * welsh_colorisation_swatches gives from scratch with the swatches left in the session (in id order)
+ *
+ */
+
+#include <stdio.h>
+
+#include "WelshColorisation.hpp"
+
+#define WIDTH 160
+#define HEIGHT 120
+
+static int failures = 0;
+
+/**
+ * @brief Colorful source: hue varying along x, with a texture so that the samples differ
+ */
+static Mat make_source() {
+    Mat hsv(HEIGHT, WIDTH, CV_8UC3), bgr;
+    RNG rng(1);
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            hsv.at<Vec3b>(y, x) = Vec3b(x * 180 / WIDTH, 200 + rng.uniform(0, 56), 80 + (x * y) % 96 + rng.uniform(0, 48));
+        }
+    }
+    cvtColor(hsv, bgr, COLOR_HSV2BGR);
+    return bgr;
+}
+
+/**
+ * @brief Grayscale target (BGR) with smooth regions, edges and noise
+ */
+static Mat make_target() {
+    Mat gray(HEIGHT, WIDTH, CV_8UC1), bgr;
+    RNG rng(2);
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            int value = ((x / 20 + y / 15) % 2 ? 160 : 60) + (x + 2 * y) % 40 + rng.uniform(0, 24);
+            gray.at<uchar>(y, x) = saturate_cast<uchar>(value);
+        }
+    }
+    cvtColor(gray, bgr, COLOR_GRAY2BGR);
+    return bgr;
+}
+
+/**
+ * @brief Compare the render of a session with the from-scratch colorisation with the given swatches
+ */
+static void check_render(SwatchSession& session, const Mat& source, const Mat& target, params prm, 
+                         const std::vector<Rect2d>& src_swatches, const std::vector<Rect2d>& target_swatches, const char * step) {
+    Mat rendered;
+    session.render(rendered);
+    Mat src = source.clone(), expected = target.clone();
+    welsh_colorisation_swatches(src, expected, "swatch_session_test.png", prm, src_swatches, target_swatches);
+    Mat diff;
+    absdiff(rendered, expected, diff);
+    int different = countNonZero(diff.reshape(1));
+    if (different == 0) return;
+    fprintf(stderr, "FAILED: window %u, %s: %d bytes differ from welsh_colorisation_swatches\n", prm->neighborhood_window_size, step, different);
+    failures++;
+}
+
+int main() {
+    Mat source = make_source(), target = make_target();
+    Rect2d a_src(10, 10, 30, 30), a_target(5, 70, 30, 30);
+    Rect2d b_src(60, 40, 30, 30), b_target(60, 10, 30, 30);
+    Rect2d b_moved_src(120, 80, 30, 30), b_moved_target(110, 60, 40, 40);
+    Rect2d c_src(100, 5, 40, 30), c_target(20, 20, 40, 30);     // overlaps the moved swatch b
+
+    // the error distances of the windows 9 and 11 go beyond 0xFFFF
+    const uint windows[] = { 5, 9, 11 };
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        params prm = create_default_params();
+        prm->neighborhood_window_size = windows[w];
+        SwatchSession session(source, target, *prm);
+
+        int a = session.add_swatch(a_src, a_target);
+        int b = session.add_swatch(b_src, b_target);
+        session.add_swatch(c_src, c_target);
+        check_render(session, source, target, prm, { a_src, b_src, c_src }, { a_target, b_target, c_target }, "add");
+
+        session.move_swatch(b, b_moved_src, b_moved_target);
+        check_render(session, source, target, prm, { a_src, c_src, b_moved_src }, { a_target, c_target, b_moved_target }, "move");
+
+        session.remove_swatch(a);
+        check_render(session, source, target, prm, { c_src, b_moved_src }, { c_target, b_moved_target }, "remove");
+        free(prm);
+    }
+
+    if (failures == 0) printf("swatch_session_test: all checks passed\n");
+    return failures == 0 ? 0 : 1;
+}